@@ -1,6 +1,7 @@
 #include "esp_camera.h"
 #include <WiFi.h>
-#include <EEPROM.h>
+#include "settings.h"
+#include "camera_control.h"
 
 //
 // WARNING!!! Make sure that you have either selected ESP32 Wrover Module,
@@ -98,8 +99,6 @@ unsigned long startMillis = millis();
 #error "Camera model not selected"
 #endif
 
-#define EEPROM_SIZE 25
-
 void startCameraServer();
 void local_stream_handler();
 
@@ -129,67 +128,20 @@ void setup() {
   config.pin_pwdn = PWDN_GPIO_NUM;
   config.pin_reset = RESET_GPIO_NUM;
   config.xclk_freq_hz = 20000000;
-  config.pixel_format = PIXFORMAT_JPEG;
-  //init with high specs to pre-allocate larger buffers
-  if(psramFound()){
-    config.frame_size = FRAMESIZE_UXGA;
-    config.jpeg_quality = 10;
-    config.fb_count = 2;
-  } else {
-    config.frame_size = FRAMESIZE_SVGA;
-    config.jpeg_quality = 12;
-    config.fb_count = 1;
-  }
 
 #if defined(CAMERA_MODEL_ESP_EYE)
   pinMode(13, INPUT_PULLUP);
   pinMode(14, INPUT_PULLUP);
 #endif
 
-  // camera init
-  esp_err_t err = esp_camera_init(&config);
+  // camera init, format and frame size come from the stored settings
+  settings_begin();
+  camera_control_begin(&config);
+  esp_err_t err = camera_control_init();
   if (err != ESP_OK) {
-    Serial.printf("Camera init failed with error 0x%x", err);
     return;
   }
 
-  //drop down frame size for higher initial frame rate
-  sensor_t * s = esp_camera_sensor_get();
-
-  EEPROM.begin(EEPROM_SIZE);
-  s->set_framesize(s,       (framesize_t)EEPROM.read(0));
-  s->set_quality(s,         EEPROM.read(1));
-  s->set_contrast(s,        EEPROM.read(2));
-  s->set_brightness(s,      EEPROM.read(3));
-  s->set_saturation(s,      EEPROM.read(4));
-  s->set_gainceiling(s,     (gainceiling_t)EEPROM.read(5));
-  s->set_colorbar(s,        EEPROM.read(6));
-  s->set_whitebal(s,        EEPROM.read(7));
-  s->set_gain_ctrl(s,       EEPROM.read(8));
-  s->set_exposure_ctrl(s,   EEPROM.read(9));
-  s->set_hmirror(s,         EEPROM.read(10));
-  s->set_vflip(s,           EEPROM.read(11));
-  s->set_awb_gain(s,        EEPROM.read(12));
-  s->set_agc_gain(s,        EEPROM.read(13));
-  s->set_aec_value(s,       EEPROM.read(14));
-  s->set_aec2(s,            EEPROM.read(15));
-  s->set_dcw(s,             EEPROM.read(16));
-  //s->set_bpc(s,             EEPROM.read(17));
-  //s->set_wpc(s,             EEPROM.read(18));
-  //s->set_raw_gma(s,         EEPROM.read(19));
-  //s->set_lenc(s,            EEPROM.read(20));
-  s->set_special_effect(s,  EEPROM.read(21));
-  s->set_wb_mode(s,         EEPROM.read(22));
-  s->set_ae_level(s,        EEPROM.read(23));     
-          
-    //Set default values for min/max levels
-
-    //EEPROM.write(24, 10);  
-    //EEPROM.write(25, 10);  
-    
-    //Serial.print(EEPROM.read(25));
-    EEPROM.commit();
-
   WiFi.begin(ssid, password);
 
   while (WiFi.status() != WL_CONNECTED) {
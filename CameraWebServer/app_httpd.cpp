@@ -16,6 +16,7 @@
 #include "img_converters.h"
 #include "camera_index.h"
 #include "Arduino.h"
+#include "freertos/queue.h"
 
 #include "HTTPClient.h"
 HTTPClient http;
@@ -25,8 +26,16 @@ HTTPClient http;
 #include "dl_lib.h"
 #include "fr_forward.h"
 
-#include <EEPROM.h>
-#define EEPROM_SIZE 25
+#include "settings.h"
+#include "coffee_profile.h"
+#include "trace.h"
+#include "camera_control.h"
+#include "frame_scale.h"
+#include "frame_quality.h"
+#include "recorder.h"
+#include "jpeg_dct.h"
+#include "coffee_analyze.h"
+#include "stream_server.h"
 
 #define ENROLL_CONFIRM_TIMES 5
 
@@ -48,13 +57,49 @@ typedef struct {
         size_t len;
 } jpg_chunking_t;
 
-#define PART_BOUNDARY "123456789000000000000987654321"
-static const char* _STREAM_CONTENT_TYPE = "multipart/x-mixed-replace;boundary=" PART_BOUNDARY;
-static const char* _STREAM_BOUNDARY = "\r\n--" PART_BOUNDARY "\r\n";
-static const char* _STREAM_PART = "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+
+#define BURST_MAX_FRAMES 9
+#define BURST_INLIER_SPREAD 5.0 //percent, readings this close to the fused level count towards confidence
+#define BURST_FUSION_MEDIAN 0
+#define BURST_FUSION_TRIMMED_MEAN 1
+
+#define PREVIEW_SOURCE_ANNOTATED 0
+#define PREVIEW_SOURCE_SENSOR 1
+
+#define ANALYZE_RECV_RETRIES 3 //receive timeouts (recv_wait_timeout each) before an /analyze upload is dropped
+
+typedef struct {
+        camera_fb_t *fb; //held until analyzed when the frame is read in place (grayscale)
+        dl_matrix3du_t *matrix; //analysis pixels: BGR888, or the Y plane of a YUV422 frame
+        dl_matrix3du_t *decoded; //full size BGR888 when a JPEG/RGB565 frame is analyzed scaled
+        int shift; //analysis_scale the buffers were sized for
+        fb_data_t frame; //what coffee_level() analyzes
+        bool loaded; //frame holds a captured frame
+        frame_quality_reason_t quality; //quality gate verdict for frame
+        recorder_header_t *record; //copy of the sensor frame for /record, NULL when not recording
+        int engine; //analysis_engine the buffers were sized for
+        int *dct_rows; //JPEG DCT engine: ROI row profile, one entry per sensor row
+        dl_matrix3du_t *thumb; //JPEG DCT engine: luma block means, the gate and exists marker read these
+        bool dct; //dct_peak holds this frame's profile
+        coffee_peak_t dct_peak;
+        int width; //sensor frame size
+        int height;
+        uint32_t decode_us; //load time of each engine, compare mode
+        uint32_t dct_us;
+} measure_slot_t;
+
+typedef struct {
+        measure_slot_t slot[2]; //one is analyzed while the other is loaded
+        QueueHandle_t free_q; //slots to capture and load a frame into
+        QueueHandle_t ready_q; //slots back from the capture task, see measure_slot_t.loaded
+        TaskHandle_t task;
+        uint32_t quality_count[FRAME_QUALITY_REASONS]; //frames per gate verdict since boot
+        uint32_t compare_frames; //compare mode: frames measured by both engines
+        uint32_t compare_agree; //of those, levels within BURST_INLIER_SPREAD
+} burst_t;
 
 static ra_filter_t ra_filter;
-httpd_handle_t stream_httpd = NULL;
+static burst_t burst = {0};
 httpd_handle_t camera_httpd = NULL;
 
 static mtmn_config_t mtmn_config = {0};
@@ -124,144 +169,185 @@ static int rgb_printf(dl_matrix3du_t *image_matrix, uint32_t color, const char *
 }
 
 
-static void coffee_level(dl_matrix3du_t *image_matrix, boolean draw_only = true){
-    //Serial.println("drawing line");
-
-    int x, y, w, h, i;
-    float send_value;
-    float coffee_exists_level;
-    int coffee_exists = 1;
-    uint32_t color_green = COLOR_GREEN;
-    uint32_t color_red = COLOR_RED;
+static fb_data_t matrix_frame(dl_matrix3du_t *image_matrix){
     fb_data_t fb;
     fb.width = image_matrix->w;
     fb.height = image_matrix->h;
     fb.data = image_matrix->item;
-    fb.bytes_per_pixel = 3;
+    fb.bytes_per_pixel = image_matrix->c;
     fb.format = FB_BGR888;
+    return fb;
+}
 
-    int h_avg = 0;
-    int h_last = 0;
-    int h_values[fb.height]; 
-    int min_line_y = abs((float)fb.height / 100 * EEPROM.read(24)/*Min*/ - fb.height);
-    int max_line_y = abs((float)fb.height / 100 * EEPROM.read(25)/*Max*/ - fb.height);
-    int left_line_x = (float)fb.width / 100 * EEPROM.read(26)/*Left*/;
-    int right_line_x = (float)fb.width / 100 * EEPROM.read(27)/*Right*/;
-    int coffee_exists_x = (float)fb.width / 100 * EEPROM.read(21)/*Coffee Exists X*/;
-    int coffee_exists_y = (float)fb.height / 100 * EEPROM.read(22)/*Coffee Exists Y*/;
-    int coffee_exists_threshold = EEPROM.read(8)/*Coffee Exists Threshold*/;
-
-    int vflip = EEPROM.read(11)/*VFlip*/;
-    
-    for(int i = 0; i < fb.height; i++){
+// Box-filtered copy of image at 1/2^shift, or NULL if the allocation fails.
+static dl_matrix3du_t *matrix_downscale(const fb_data_t *image, int shift){
+    dl_matrix3du_t *matrix = dl_matrix3du_alloc(1, image->width >> shift, image->height >> shift, image->bytes_per_pixel);
+    if(matrix){
+        TRACE_BEGIN("downscale");
+        frame_downscale(image->data, image->width, image->height, image->bytes_per_pixel, image->bytes_per_pixel, shift, matrix->item);
+        TRACE_END("downscale");
+    }
+    return matrix;
+}
 
-      h_avg = 0;
-      
-      for(int k = left_line_x*fb.bytes_per_pixel; k < fb.width*fb.bytes_per_pixel - (fb.width-right_line_x)*fb.bytes_per_pixel; k++){
-        h_avg = h_avg + *(fb.data + i*fb.width*fb.bytes_per_pixel + k);
-      }
+// Setting behind each coffee_param_t.
+static constexpr size_t coffee_param_setting[COFFEE_PARAM_COUNT] = {
+    SETTING_ID("coffee_min"),
+    SETTING_ID("coffee_max"),
+    SETTING_ID("coffee_left"),
+    SETTING_ID("coffee_right"),
+    SETTING_ID("coffee_exists_x"),
+    SETTING_ID("coffee_exists_y"),
+    SETTING_ID("coffee_exists_threshold"),
+    SETTING_ID("dct_terms"),
+    SETTING_ID("quality_dark"),
+    SETTING_ID("quality_saturated"),
+    SETTING_ID("quality_sharpness"),
+    SETTING_ID("analysis_scale"),
+};
+
+static constexpr int coffee_param_defaults[COFFEE_PARAM_COUNT] = COFFEE_PARAM_DEFAULTS;
+
+static constexpr bool coffee_param_defaults_match(size_t i){
+    return i >= COFFEE_PARAM_COUNT ||
+        (settings_table[coffee_param_setting[i]].def == coffee_param_defaults[i] && coffee_param_defaults_match(i + 1));
+}
 
-      h_avg = int(h_avg / (fb.width*fb.bytes_per_pixel));
+static_assert(coffee_param_defaults_match(0), "COFFEE_PARAM_DEFAULTS differs from the settings defaults");
 
-      if(EEPROM.read(19)/*Obscure*/ == true){
-        for(int k = 0; k < fb.width*fb.bytes_per_pixel; k++){
-          *(fb.data + i*fb.width*fb.bytes_per_pixel + k) = h_avg;
-        }
-      }
-      
-      h_values[i] = abs(h_avg - h_last);     
-      h_last = h_avg;
-      
-    }
-
-    int last_max = 0;
-    int h_max = 0;
-    for(int i = 5; i < fb.height - 5; i++){
-      //Serial.println(h_values[i]);
-      if(h_values[i] > last_max){
-        h_max = i;
-        last_max = h_values[i];
-        
-      }
-      
+// Analysis parameters from the stored settings.
+static coffee_params_t coffee_params(){
+    coffee_params_t params;
+    for(int i = 0; i < COFFEE_PARAM_COUNT; i++){
+        params.value[i] = settings_read(coffee_param_setting[i]);
     }
+    return params;
+}
 
-    coffee_exists_level = *(fb.data + coffee_exists_y*fb.width*fb.bytes_per_pixel + coffee_exists_x*fb.bytes_per_pixel);
+static coffee_geometry_t coffee_geometry(int width, int height){
+    coffee_params_t params = coffee_params();
+    return coffee_geometry_of(&params, width, height);
+}
 
-    send_value = abs(( (float)(h_max - max_line_y) / (float)(min_line_y - max_line_y) * 100) -100 );
+static coffee_reading_t coffee_result(int width, int height, int h_max, float coffee_exists_level){
+    coffee_params_t params = coffee_params();
+    return coffee_reading_of(&params, width, height, h_max, coffee_exists_level);
+}
 
+// image is BGR888, or a 1 byte per pixel luma plane (grayscale/YUV422
+// capture). Only reads the frame; coffee_draw() does the overlay.
+static coffee_reading_t coffee_level(const fb_data_t *image){
+    float coffee_exists_level;
+    fb_data_t fb = *image;
+    coffee_geometry_t g = coffee_geometry(fb.width, fb.height);
 
-    if(coffee_exists_level > coffee_exists_threshold){
-      coffee_exists = 0;
-    }
-    
-    String str_send_value = (String)send_value;
+    int row_avg[fb.height];
     
-    if(draw_only == true){
-      // rectangle box
-      x = 0;
-      y = h_max;
-      w = fb.width;
-      h = fb.height;
-
-      fb_gfx_drawFastHLine(&fb, x, min_line_y, w, color_green); //Min Line
-      fb_gfx_drawFastHLine(&fb, x, max_line_y, w, color_green); //Max Line
-      fb_gfx_drawFastVLine(&fb, left_line_x, 0, h, color_green); //Left Line
-      fb_gfx_drawFastVLine(&fb, right_line_x, 0, h, color_green); //Right Line
-
-      if(coffee_exists == 1){
-        fb_gfx_fillRect(&fb, coffee_exists_x-5, coffee_exists_x-5, 10, 10, color_green);  //Coffee Pot Exists Marker
-      }else{
-        fb_gfx_fillRect(&fb, coffee_exists_x-5, coffee_exists_x-5, 10, 10, color_red);  //Coffee Pot Exists Marker
-      }
+    coffee_frame_t frame = { fb.data, fb.width, fb.height, fb.bytes_per_pixel, g.left_line_x, g.right_line_x };
+    coffee_peak_t peak = coffee_profile(&frame, row_avg, settings_read(SETTING_ID("analysis_workers")));
+    int h_max = peak.line_y;
 
-      fb_gfx_fillRect(&fb, x, y, 30, 5, color_green);  //Coffee Level Marker
+    coffee_exists_level = *(fb.data + g.exists_y*fb.width*fb.bytes_per_pixel + g.exists_x*fb.bytes_per_pixel);
 
-      if(EEPROM.read(18)/*Text*/ == true){
-        fb_gfx_print(&fb, 40, y-10, color_green, &str_send_value[0]);
-      }
-      
-    }else{
-      Serial.println("-------------------------------------------");
+    return coffee_result(fb.width, fb.height, h_max, coffee_exists_level);
+}
 
-      if(coffee_exists && send_value > 0 && send_value < 100){ //Make sure the vertical measurement is within the max and min bounds
-        //Serial.println( send_value );
-        String address = "http://php-alnino200534546.codeanyapp.com/coffee/api.php?value=" + (String)send_value + "&cups=" + (String)EEPROM.read(17)/*Cups*/ + "&pot_id=" + (String)EEPROM.read(20)/*PotID*/ + "&exists=" + coffee_exists;
-  
-        int httpCode = 0;
-        http.begin(address); //HTTP
-        httpCode = http.GET();
-
-        if (httpCode > 0) { //Check for the returning code
-   
-          String payload = http.getString();
-          Serial.println("Address: " + address);
-          Serial.println("Response: " + (String)httpCode);
-          Serial.println("Level: " + (String)payload);
-          Serial.println("Cups: " + (String)EEPROM.read(17)/*Cups*/);
-          Serial.println("Pot ID: " + (String)EEPROM.read(20)/*PotID*/);
-          Serial.println("Coffee Exists: " + (String)coffee_exists);
-   
-        }else {
-              Serial.println("Error on HTTP request");
-        }
-        
-      }else{
-          Serial.println("Outside bounds: " + (String)send_value);
-          Serial.println("Coffee Exists: " + (String)coffee_exists);
+// Reading of a JPEG profiled by the DCT engine. The exists marker reads the
+// luma mean of the 8x8 block under it.
+static coffee_reading_t coffee_level_dct(const coffee_peak_t *peak, const dl_matrix3du_t *thumb, int width, int height){
+    coffee_geometry_t g = coffee_geometry(width, height);
+    float coffee_exists_level = thumb->item[(g.exists_y / 8) * thumb->w + g.exists_x / 8];
+    return coffee_result(width, height, peak->line_y, coffee_exists_level);
+}
+
+// Draws reading onto a BGR888 preview, which may be a different size than
+// the frame it was measured on.
+static void coffee_draw(fb_data_t *image, const coffee_reading_t *reading){
+    int x, y, w, h;
+    uint32_t color_green = COLOR_GREEN;
+    uint32_t color_red = COLOR_RED;
+    fb_data_t fb = *image;
+
+    if(fb.bytes_per_pixel != 3){
+      return;
+    }
+    coffee_geometry_t g = coffee_geometry(fb.width, fb.height);
+
+    //row_avg on the heap: a raw VGA preview has 480 rows (1.9 KB), and this
+    //runs on the 4 KB stream_render task stack next to fb_gfx and String
+    int *row_avg = settings_read(SETTING_ID("coffee_obscure")) == true ? (int *)malloc(fb.height * sizeof(int)) : NULL;
+    if(row_avg){
+      coffee_frame_t frame = { fb.data, fb.width, fb.height, fb.bytes_per_pixel, g.left_line_x, g.right_line_x };
+      coffee_profile(&frame, row_avg, 1);
+      for(int i = 0; i < fb.height; i++){
+        memset(fb.data + i*fb.width*fb.bytes_per_pixel, row_avg[i], fb.width*fb.bytes_per_pixel);
       }
-        
-      
+      free(row_avg);
+    }
 
+    String str_send_value = (String)reading->level;
 
-      http.end(); //Free the resources
+    // rectangle box
+    x = 0;
+    y = reading->height ? reading->line_y * fb.height / reading->height : reading->line_y;
+    w = fb.width;
+    h = fb.height;
 
-    }      
-    
+    fb_gfx_drawFastHLine(&fb, x, g.min_line_y, w, color_green); //Min Line
+    fb_gfx_drawFastHLine(&fb, x, g.max_line_y, w, color_green); //Max Line
+    fb_gfx_drawFastVLine(&fb, g.left_line_x, 0, h, color_green); //Left Line
+    fb_gfx_drawFastVLine(&fb, g.right_line_x, 0, h, color_green); //Right Line
+
+    if(reading->exists == 1){
+      fb_gfx_fillRect(&fb, g.exists_x-5, g.exists_x-5, 10, 10, color_green);  //Coffee Pot Exists Marker
+    }else{
+      fb_gfx_fillRect(&fb, g.exists_x-5, g.exists_x-5, 10, 10, color_red);  //Coffee Pot Exists Marker
+    }
 
+    fb_gfx_fillRect(&fb, x, y, 30, 5, color_green);  //Coffee Level Marker
 
-    
+    if(settings_read(SETTING_ID("coffee_text")) == true){
+      fb_gfx_print(&fb, 40, y-10, color_green, &str_send_value[0]);
+    }
+}
+
+static void coffee_report(const coffee_reading_t *reading, float confidence){
+    float send_value = reading->level;
+    int coffee_exists = reading->exists;
+
+    Serial.println("-------------------------------------------");
+
+    if(coffee_exists && send_value > 0 && send_value < 100){ //Make sure the vertical measurement is within the max and min bounds
+      //Serial.println( send_value );
+      String address = "http://php-alnino200534546.codeanyapp.com/coffee/api.php?value=" + (String)send_value + "&cups=" + (String)settings_read(SETTING_ID("coffee_cups")) + "&pot_id=" + (String)settings_read(SETTING_ID("coffee_potid")) + "&exists=" + coffee_exists + "&confidence=" + (String)confidence;
+
+      int httpCode = 0;
+      http.begin(address); //HTTP
+      TRACE_BEGIN("uplink");
+      httpCode = http.GET();
+      TRACE_END("uplink");
+
+      if (httpCode > 0) { //Check for the returning code
+ 
+        String payload = http.getString();
+        Serial.println("Address: " + address);
+        Serial.println("Response: " + (String)httpCode);
+        Serial.println("Level: " + (String)payload);
+        Serial.println("Cups: " + (String)settings_read(SETTING_ID("coffee_cups")));
+        Serial.println("Pot ID: " + (String)settings_read(SETTING_ID("coffee_potid")));
+        Serial.println("Coffee Exists: " + (String)coffee_exists);
+        Serial.println("Confidence: " + (String)confidence);
+ 
+      }else {
+            Serial.println("Error on HTTP request");
+      }
+      
+    }else{
+        Serial.println("Outside bounds: " + (String)send_value);
+        Serial.println("Coffee Exists: " + (String)coffee_exists);
+    }
 
+    http.end(); //Free the resources
 }
 
 
@@ -279,14 +365,18 @@ static size_t jpg_encode_stream(void * arg, size_t index, const void* data, size
 }
 
 static esp_err_t capture_handler(httpd_req_t *req){
+    TRACE_SCOPE("capture_handler");
     camera_fb_t * fb = NULL;
     esp_err_t res = ESP_OK;
     int64_t fr_start = esp_timer_get_time();
 
+    camera_acquire();
+    TRACE_BEGIN("fb_get");
     fb = esp_camera_fb_get();
-    Serial.println(sizeof(fb->buf));
+    TRACE_END("fb_get");
 
     if (!fb) {
+        camera_release();
         Serial.println("Camera capture failed");
         httpd_resp_send_500(req);
         return ESP_FAIL;
@@ -310,6 +400,7 @@ static esp_err_t capture_handler(httpd_req_t *req){
             fb_len = jchunk.len;
         }
         esp_camera_fb_return(fb);
+        camera_release();
         int64_t fr_end = esp_timer_get_time();
         Serial.printf("JPG: %uB %ums\n", (uint32_t)(fb_len), (uint32_t)((fr_end - fr_start)/1000));
         return res;
@@ -318,6 +409,7 @@ static esp_err_t capture_handler(httpd_req_t *req){
     dl_matrix3du_t *image_matrix = dl_matrix3du_alloc(1, fb->width, fb->height, 3);
     if (!image_matrix) {
         esp_camera_fb_return(fb);
+        camera_release();
         Serial.println("dl_matrix3du_alloc failed");
         httpd_resp_send_500(req);
         return ESP_FAIL;
@@ -328,8 +420,11 @@ static esp_err_t capture_handler(httpd_req_t *req){
     out_width = fb->width;
     out_height = fb->height;
 
+    TRACE_BEGIN("decode");
     s = fmt2rgb888(fb->buf, fb->len, fb->format, out_buf);
+    TRACE_END("decode");
     esp_camera_fb_return(fb);
+    camera_release();
     if(!s){
         dl_matrix3du_free(image_matrix);
         Serial.println("to rgb888 failed");
@@ -338,7 +433,9 @@ static esp_err_t capture_handler(httpd_req_t *req){
     }
 
     jpg_chunking_t jchunk = {req, 0};
+    TRACE_BEGIN("encode");
     s = fmt2jpg_cb(out_buf, out_len, out_width, out_height, PIXFORMAT_RGB888, 90, jpg_encode_stream, &jchunk);
+    TRACE_END("encode");
     dl_matrix3du_free(image_matrix);
     if(!s){
         Serial.println("JPEG compression failed");
@@ -349,14 +446,413 @@ static esp_err_t capture_handler(httpd_req_t *req){
     return res;
 }
 
+// Whether the JPEG DCT engine measures fb, without a pixel decode unless
+// the engines are being compared.
+static bool measure_dct(const camera_fb_t *fb, int engine){
+    return fb->format == PIXFORMAT_JPEG && engine != ANALYSIS_ENGINE_DECODE;
+}
+
+// Whether fb can be analyzed at 1/2^shift. JPEG/RGB565 frames are decoded
+// at full size first, so those stay limited to 400 pixels wide; raw frames
+// only need the scaled buffer to be. The DCT engine has no size limit.
+static bool measure_fits(const camera_fb_t *fb, int shift, int engine){
+    bool raw = fb->format == PIXFORMAT_GRAYSCALE || fb->format == PIXFORMAT_YUV422;
+    if(measure_dct(fb, engine) && engine != ANALYSIS_ENGINE_COMPARE){
+        return true;
+    }
+    return (fb->width >> shift) <= 400 && (raw || fb->width <= 400);
+}
+
+static bool measure_slot_alloc(measure_slot_t *slot, const camera_fb_t *fb, int shift, int engine){
+    bool raw = fb->format == PIXFORMAT_GRAYSCALE || fb->format == PIXFORMAT_YUV422;
+    slot->fb = NULL;
+    slot->matrix = NULL;
+    slot->decoded = NULL;
+    slot->shift = shift;
+    slot->loaded = false;
+    slot->record = NULL;
+    slot->engine = engine;
+    slot->dct_rows = NULL;
+    slot->thumb = NULL;
+    slot->dct = false;
+
+    if(measure_dct(fb, engine)){
+        slot->dct_rows = (int *)malloc(fb->height * sizeof(int));
+        slot->thumb = dl_matrix3du_alloc(1, JPEG_DCT_THUMB_WIDTH(fb->width), JPEG_DCT_THUMB_HEIGHT(fb->height), 1);
+        if(!slot->dct_rows || !slot->thumb){
+            return false;
+        }
+        if(engine == ANALYSIS_ENGINE_DCT){
+            return true;
+        }
+    }
+    if(fb->format == PIXFORMAT_GRAYSCALE && !shift){
+        return true;
+    }
+    slot->matrix = dl_matrix3du_alloc(1, fb->width >> shift, fb->height >> shift, raw ? 1 : 3);
+    if(!raw && shift){
+        slot->decoded = dl_matrix3du_alloc(1, fb->width, fb->height, 3);
+        return slot->matrix && slot->decoded;
+    }
+    return slot->matrix != NULL;
+}
+
+// Profiles a JPEG frame from its DCT coefficients into dct_rows/dct_peak.
+static bool measure_slot_dct(measure_slot_t *slot, const camera_fb_t *fb){
+    coffee_geometry_t g = coffee_geometry(fb->width, fb->height);
+    jpeg_dct_frame_t frame = { fb->buf, fb->len, (int)fb->width, (int)fb->height, g.left_line_x, g.right_line_x, settings_read(SETTING_ID("dct_terms")) };
+
+    int64_t start = esp_timer_get_time();
+    TRACE_BEGIN("dct");
+    slot->dct = jpeg_dct_profile(&frame, slot->dct_rows, slot->thumb->item, &slot->dct_peak);
+    TRACE_END("dct");
+    slot->dct_us = esp_timer_get_time() - start;
+    return slot->dct;
+}
+
+// Runs the quality gate over the coffee ROI of the loaded frame.
+static frame_quality_reason_t measure_slot_quality(const measure_slot_t *slot){
+    const fb_data_t *fb = &slot->frame;
+    frame_quality_limits_t limits;
+    frame_quality_t quality;
+
+    limits.dark_percent = settings_read(SETTING_ID("quality_dark"));
+    limits.saturated_percent = settings_read(SETTING_ID("quality_saturated"));
+    limits.min_sharpness = settings_read(SETTING_ID("quality_sharpness"));
+
+    coffee_geometry_t g = coffee_geometry(fb->width, fb->height);
+    coffee_frame_t frame = { fb->data, fb->width, fb->height, fb->bytes_per_pixel, g.left_line_x, g.right_line_x };
+    TRACE_BEGIN("quality");
+    frame_quality_measure(&frame, &quality);
+    TRACE_END("quality");
+    return frame_quality_check(&quality, &limits);
+}
+
+// Takes ownership of fb. Unscaled grayscale frames are analyzed in place and
+// the frame buffer is kept until measure_slot_release(). Otherwise the luma
+// (grayscale/YUV422) or the decoded BGR888 frame (JPEG/RGB565) is box
+// filtered down to the analysis buffer.
+static bool measure_slot_load(measure_slot_t *slot, camera_fb_t *fb){
+    fb_data_t *frame = &slot->frame;
+    int shift = slot->shift;
+    bool loaded = false;
+
+    slot->record = recorder_claim(fb, esp_timer_get_time());
+    slot->width = fb->width;
+    slot->height = fb->height;
+    slot->dct = false;
+
+    if(slot->thumb && fb->format == PIXFORMAT_JPEG){
+        bool profiled = measure_slot_dct(slot, fb);
+        if(slot->engine == ANALYSIS_ENGINE_DCT){
+            //the thumbnail stands in for the frame in the quality gate
+            *frame = matrix_frame(slot->thumb);
+            esp_camera_fb_return(fb);
+            if(profiled){
+                slot->quality = measure_slot_quality(slot);
+            }
+            return profiled;
+        }
+    }
+
+    frame->width = fb->width;
+    frame->height = fb->height;
+    frame->format = FB_BGR888;
+    if(fb->format == PIXFORMAT_GRAYSCALE && !shift){
+        slot->fb = fb;
+        frame->data = fb->buf;
+        frame->bytes_per_pixel = 1;
+        slot->quality = measure_slot_quality(slot);
+        return true;
+    }
+
+    if(slot->matrix && slot->matrix->w == (fb->width >> shift) && slot->matrix->h == (fb->height >> shift)){
+        int64_t start = esp_timer_get_time();
+        TRACE_BEGIN("decode");
+        if(fb->format == PIXFORMAT_GRAYSCALE){
+            frame_downscale(fb->buf, fb->width, fb->height, 1, 1, shift, slot->matrix->item);
+            loaded = true;
+        } else if(fb->format == PIXFORMAT_YUV422){
+            //YUYV, luma is every other byte
+            frame_downscale(fb->buf, fb->width, fb->height, 2, 1, shift, slot->matrix->item);
+            loaded = true;
+        } else if(!shift){
+            loaded = fmt2rgb888(fb->buf, fb->len, fb->format, slot->matrix->item);
+        } else if(slot->decoded){
+            loaded = fmt2rgb888(fb->buf, fb->len, fb->format, slot->decoded->item);
+            if(loaded){
+                frame_downscale(slot->decoded->item, fb->width, fb->height, 3, 3, shift, slot->matrix->item);
+            }
+        }
+        TRACE_END("decode");
+        slot->decode_us = esp_timer_get_time() - start;
+        *frame = matrix_frame(slot->matrix);
+    }
+    esp_camera_fb_return(fb);
+    if(loaded){
+        slot->quality = measure_slot_quality(slot);
+    }
+    return loaded;
+}
+
+static void measure_slot_release(measure_slot_t *slot){
+    if(slot->record){
+        recorder_discard(slot->record);
+        slot->record = NULL;
+    }
+    if(slot->fb){
+        esp_camera_fb_return(slot->fb);
+        slot->fb = NULL;
+    }
+}
+
+static void measure_slot_free(measure_slot_t *slot){
+    measure_slot_release(slot);
+    if(slot->matrix){
+        dl_matrix3du_free(slot->matrix);
+        slot->matrix = NULL;
+    }
+    if(slot->decoded){
+        dl_matrix3du_free(slot->decoded);
+        slot->decoded = NULL;
+    }
+    if(slot->thumb){
+        dl_matrix3du_free(slot->thumb);
+        slot->thumb = NULL;
+    }
+    free(slot->dct_rows);
+    slot->dct_rows = NULL;
+}
+
+// Burst measurement: frame 0 is captured and loaded by the caller, then
+// burst_capture_task (core 0) captures and loads frame N+1 into the spare
+// slot while the loop task (core 1) analyzes frame N. Frames failing the
+// quality gate are dropped before analysis and, up to quality_retries, make
+// the burst one frame longer. The per-frame readings are fused into one
+// report.
+//
+// The capture task loads one frame for every slot sent on free_q and hands
+// the slot back on ready_q, so the loop task decides how many frames a burst
+// takes.
+static void burst_capture_task(void *arg){
+    while(true){
+        int slot;
+        xQueueReceive(burst.free_q, &slot, portMAX_DELAY);
+
+        TRACE_BEGIN("fb_get");
+        camera_fb_t *fb = esp_camera_fb_get();
+        TRACE_END("fb_get");
+        burst.slot[slot].loaded = fb && measure_slot_load(&burst.slot[slot], fb);
+        xQueueSend(burst.ready_q, &slot, portMAX_DELAY);
+    }
+}
+
+static bool burst_init(){
+    if(burst.task){
+        return true;
+    }
+    burst.free_q = xQueueCreate(2, sizeof(int));
+    burst.ready_q = xQueueCreate(2, sizeof(int));
+    if(!burst.free_q || !burst.ready_q){
+        return false;
+    }
+    return xTaskCreatePinnedToCore(burst_capture_task, "burst", 4096, NULL, 2, &burst.task, 0) == pdPASS;
+}
+
+static coffee_reading_t burst_fuse(const coffee_reading_t *readings, int count, int frames, float *confidence){
+    float levels[BURST_MAX_FRAMES];
+    int votes = 0;
+    coffee_reading_t fused = readings[0];
+
+    for(int i = 0; i < count; i++){
+        float level = readings[i].level;
+        int j = i;
+        while(j > 0 && levels[j-1] > level){
+            levels[j] = levels[j-1];
+            j--;
+        }
+        levels[j] = level;
+        votes += readings[i].exists;
+    }
+
+    if(settings_read(SETTING_ID("burst_fusion")) == BURST_FUSION_TRIMMED_MEAN){
+        int trim = count / 4;
+        float sum = 0;
+        for(int i = trim; i < count - trim; i++){
+            sum += levels[i];
+        }
+        fused.level = sum / (count - 2 * trim);
+    } else if(count % 2){
+        fused.level = levels[count / 2];
+    } else {
+        fused.level = (levels[count / 2 - 1] + levels[count / 2]) / 2;
+    }
+    fused.exists = votes * 2 >= count;
+
+    int inliers = 0;
+    float best = 1000;
+    for(int i = 0; i < count; i++){
+        float d = fabsf(readings[i].level - fused.level);
+        if(d <= BURST_INLIER_SPREAD && readings[i].exists == fused.exists){
+            inliers++;
+        }
+        if(d < best){
+            best = d;
+            fused.line_y = readings[i].line_y;
+        }
+    }
+    *confidence = (float)inliers / frames;
+    return fused;
+}
+
+// Compare mode: logs the DCT engine's reading and load time next to the
+// decode engine's for the same frame.
+static void burst_compare(const coffee_reading_t *decoded, const measure_slot_t *m){
+    coffee_reading_t dct = coffee_level_dct(&m->dct_peak, m->thumb, m->width, m->height);
+    burst.compare_frames++;
+    if(fabsf(dct.level - decoded->level) <= BURST_INLIER_SPREAD && dct.exists == decoded->exists){
+        burst.compare_agree++;
+    }
+    Serial.printf("Engines: decode %.1f%% line %d %uus, dct %.1f%% line %d %uus, agree %u/%u\n",
+        decoded->level, decoded->line_y << m->shift, m->decode_us, dct.level, dct.line_y, m->dct_us, burst.compare_agree, burst.compare_frames);
+}
+
+static bool burst_measure(coffee_reading_t *reading, float *confidence){
+    coffee_reading_t readings[BURST_MAX_FRAMES];
+    int frames = settings_read(SETTING_ID("burst_frames"));
+    int retries = settings_read(SETTING_ID("quality_retries"));
+    int shift = settings_read(SETTING_ID("analysis_scale"));
+    int engine = settings_read(SETTING_ID("analysis_engine"));
+    int count = 0;
+    int rejected = 0;
+    int64_t fr_start = esp_timer_get_time();
+
+    TRACE_BEGIN("fb_get");
+    camera_fb_t *fb = esp_camera_fb_get();
+    TRACE_END("fb_get");
+    if (!fb) {
+        Serial.println("Camera capture failed");
+        return false;
+    }
+    if(!measure_fits(fb, shift, engine)){
+        esp_camera_fb_return(fb);
+        Serial.println("Frame too large to measure");
+        return false;
+    }
+
+    //frames wanted and frames handed to the capture task so far
+    int target = frames;
+    int requested = 1;
+    if (!measure_slot_alloc(&burst.slot[0], fb, shift, engine) || (frames > 1 && !measure_slot_alloc(&burst.slot[1], fb, shift, engine))) {
+        Serial.println("dl_matrix3du_alloc failed");
+        esp_camera_fb_return(fb);
+        target = requested = 0;
+    } else {
+        burst.slot[0].loaded = measure_slot_load(&burst.slot[0], fb);
+        if(!burst.slot[0].loaded){
+            Serial.println("fmt2rgb888 failed");
+        }
+    }
+
+    if(target && (target > 1 || retries) && !burst_init()){
+        Serial.println("Burst task start failed");
+        target = 1;
+        retries = 0;
+    }
+    if(target > 1){
+        int slot = 1;
+        xQueueSend(burst.free_q, &slot, portMAX_DELAY);
+        requested++;
+    }
+
+    int slot = 0;
+    for(int k = 0; k < requested; k++){
+        if(k > 0){
+            xQueueReceive(burst.ready_q, &slot, portMAX_DELAY);
+        }
+        measure_slot_t *m = &burst.slot[slot];
+        if(m->record){
+            m->record->burst_index = k;
+        }
+        if(m->loaded){
+            burst.quality_count[m->quality]++;
+            if(m->record){
+                m->record->quality = m->quality;
+            }
+            if(m->quality == FRAME_QUALITY_OK){
+                TRACE_BEGIN("analyze");
+                if(m->dct && m->engine == ANALYSIS_ENGINE_DCT){
+                    readings[count++] = coffee_level_dct(&m->dct_peak, m->thumb, m->width, m->height);
+                } else {
+                    readings[count++] = coffee_level(&m->frame);
+                }
+                TRACE_END("analyze");
+                if(m->dct && m->engine == ANALYSIS_ENGINE_COMPARE){
+                    burst_compare(&readings[count-1], m);
+                }
+                if(m->record){
+                    m->record->analyzed = 1;
+                    m->record->level = readings[count-1].level;
+                    m->record->line_y = readings[count-1].line_y;
+                    m->record->analysis_height = readings[count-1].height;
+                    m->record->exists = readings[count-1].exists;
+                }
+            } else {
+                rejected++;
+                if(retries > 0){
+                    retries--;
+                    target++;
+                }
+            }
+        }
+        if(m->record){
+            recorder_publish(m->record);
+            m->record = NULL;
+        }
+        measure_slot_release(m);
+        if(requested < target){
+            xQueueSend(burst.free_q, &slot, portMAX_DELAY);
+            requested++;
+        }
+    }
+
+    for(int i = 0; i < 2; i++){
+        measure_slot_free(&burst.slot[i]);
+    }
+
+    int64_t fr_end = esp_timer_get_time();
+    Serial.printf("Burst: %d/%d frames, %d rejected, %ums\n", count, frames, rejected, (uint32_t)((fr_end - fr_start)/1000));
+    if(!count){
+        return false;
+    }
+    *reading = burst_fuse(readings, count, frames, confidence);
+    return true;
+}
+
 void local_stream_handler(){
+    TRACE_SCOPE("measure");
+    coffee_reading_t reading;
+    float confidence;
+
+    camera_acquire();
+    bool measured = burst_measure(&reading, &confidence);
+    camera_release();
+
+    if(measured){
+        coffee_report(&reading, confidence);
+    }
+}
+
+// One /stream frame for stream_server.cpp: the sensor JPEG, or the annotated
+// preview. Returns a malloc()ed JPEG, or NULL.
+static uint8_t *stream_render(size_t *len){
+    TRACE_SCOPE("stream_frame");
     camera_fb_t * fb = NULL;
+    esp_err_t res = ESP_OK;
     size_t _jpg_buf_len = 0;
     uint8_t * _jpg_buf = NULL;
-    char * part_buf[64];
     dl_matrix3du_t *image_matrix = NULL;
     bool detected = false;
-    
     int face_id = 0;
     int64_t fr_start = 0;
     int64_t fr_ready = 0;
@@ -369,22 +865,29 @@ void local_stream_handler(){
         last_frame = esp_timer_get_time();
     }
 
+    camera_acquire();
+    TRACE_BEGIN("fb_get");
     fb = esp_camera_fb_get();
+    TRACE_END("fb_get");
     if (!fb) {
         Serial.println("Camera capture failed");
+        res = ESP_FAIL;
     } else {
         fr_start = esp_timer_get_time();
         fr_ready = fr_start;
         fr_face = fr_start;
         fr_encode = fr_start;
         fr_recognize = fr_start;
-        if(fb->width > 400){
+        int analysis_shift = settings_read(SETTING_ID("analysis_scale"));
+        int preview_shift = settings_read(SETTING_ID("preview_scale"));
+        if(!measure_fits(fb, analysis_shift, ANALYSIS_ENGINE_DECODE) || settings_read(SETTING_ID("preview_source")) == PREVIEW_SOURCE_SENSOR){
             if(fb->format != PIXFORMAT_JPEG){
                 bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
                 esp_camera_fb_return(fb);
                 fb = NULL;
                 if(!jpeg_converted){
                     Serial.println("JPEG compression failed");
+                    res = ESP_FAIL;
                 }
             } else {
                 _jpg_buf_len = fb->len;
@@ -395,51 +898,88 @@ void local_stream_handler(){
 
             if (!image_matrix) {
                 Serial.println("dl_matrix3du_alloc failed");
+                res = ESP_FAIL;
             } else {
-                if(!fmt2rgb888(fb->buf, fb->len, fb->format, image_matrix->item)){
+                TRACE_BEGIN("decode");
+                bool decoded = fmt2rgb888(fb->buf, fb->len, fb->format, image_matrix->item);
+                TRACE_END("decode");
+                if(!decoded){
                     Serial.println("fmt2rgb888 failed");
+                    res = ESP_FAIL;
                 } else {
                     
                     fr_ready = esp_timer_get_time();
-                    //if (net_boxes || fb->format != PIXFORMAT_JPEG){
-                    if (true || fb->format != PIXFORMAT_JPEG){
-                    
-                        coffee_level(image_matrix, false);
-
-                        for(int i = 0; i < fb->height; i++){
-                          for(int i = 0; i < fb->width * 3; i = i + 3){
+                    //analysis and preview each get their own scaled copy,
+                    //shared when both use the same scale
+                    fb_data_t frame = matrix_frame(image_matrix);
+                    dl_matrix3du_t *analysis_matrix = analysis_shift ? matrix_downscale(&frame, analysis_shift) : NULL;
+                    dl_matrix3du_t *preview_matrix = analysis_matrix;
+                    if(preview_shift != analysis_shift){
+                        preview_matrix = preview_shift ? matrix_downscale(&frame, preview_shift) : NULL;
+                    }
 
-                            *(image_matrix->item + i) = *(image_matrix->item + i) - 25;
+                    if((analysis_shift && !analysis_matrix) || (preview_shift && !preview_matrix)){
+                        Serial.println("dl_matrix3du_alloc failed");
+                        res = ESP_FAIL;
+                    } else {
+                        fb_data_t analysis = analysis_matrix ? matrix_frame(analysis_matrix) : frame;
+                        fb_data_t preview = preview_matrix ? matrix_frame(preview_matrix) : frame;
+                        TRACE_BEGIN("analyze");
+                        coffee_reading_t reading = coffee_level(&analysis);
+                        TRACE_END("analyze");
+                        coffee_draw(&preview, &reading);
+
+                        for(int i = 0; i < preview.height; i++){
+                          for(int i = 0; i < preview.width * 3; i = i + 3){
+  
+                            *(preview.data + i) = *(preview.data + i) - 25;
                             
                           }
                         }                            
 
-                        if(!fmt2jpg(image_matrix->item, fb->width*fb->height*3, fb->width, fb->height, PIXFORMAT_RGB888, 90, &_jpg_buf, &_jpg_buf_len)){
+                        TRACE_BEGIN("encode");
+                        bool encoded = fmt2jpg(preview.data, preview.width*preview.height*3, preview.width, preview.height, PIXFORMAT_RGB888, 90, &_jpg_buf, &_jpg_buf_len);
+                        TRACE_END("encode");
+                        if(!encoded){
                             Serial.println("fmt2jpg failed");
+                            res = ESP_FAIL;
                         }
-                        
-                        esp_camera_fb_return(fb);
-                        fb = NULL;
-                    } else {
-                        _jpg_buf = fb->buf;
-                        _jpg_buf_len = fb->len;
                     }
+                    if(preview_matrix && preview_matrix != analysis_matrix){
+                        dl_matrix3du_free(preview_matrix);
+                    }
+                    if(analysis_matrix){
+                        dl_matrix3du_free(analysis_matrix);
+                    }
+
+                    esp_camera_fb_return(fb);
+                    fb = NULL;
                     fr_encode = esp_timer_get_time();
                 }
                 dl_matrix3du_free(image_matrix);
             }
         }
     }
-    
     if(fb){
+        //the sensor JPEG is shared with the viewers after the frame buffer
+        //has gone back to the driver
+        uint8_t *jpg = res == ESP_OK ? (uint8_t *)malloc(_jpg_buf_len) : NULL;
+        if(jpg){
+            memcpy(jpg, _jpg_buf, _jpg_buf_len);
+        } else {
+            res = ESP_FAIL;
+        }
         esp_camera_fb_return(fb);
         fb = NULL;
-        _jpg_buf = NULL;
-    } else if(_jpg_buf){
+        _jpg_buf = jpg;
+    } else if(res != ESP_OK && _jpg_buf){
         free(_jpg_buf);
         _jpg_buf = NULL;
     }
-
+    camera_release();
+    if(res != ESP_OK){
+        return NULL;
+    }
     int64_t fr_end = esp_timer_get_time();
 
     int64_t ready_time = (fr_ready - fr_start)/1000;
@@ -453,147 +993,12 @@ void local_stream_handler(){
     frame_time /= 1000;
     uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
 
-    
-
-    last_frame = 0;
-    return;
-}
-
-static esp_err_t stream_handler(httpd_req_t *req){
-    camera_fb_t * fb = NULL;
-    esp_err_t res = ESP_OK;
-    size_t _jpg_buf_len = 0;
-    uint8_t * _jpg_buf = NULL;
-    char * part_buf[64];
-    dl_matrix3du_t *image_matrix = NULL;
-    bool detected = false;
-    int face_id = 0;
-    int64_t fr_start = 0;
-    int64_t fr_ready = 0;
-    int64_t fr_face = 0;
-    int64_t fr_recognize = 0;
-    int64_t fr_encode = 0;
-
-    static int64_t last_frame = 0;
-    if(!last_frame) {
-        last_frame = esp_timer_get_time();
-    }
-
-    res = httpd_resp_set_type(req, _STREAM_CONTENT_TYPE);
-    if(res != ESP_OK){
-        return res;
-    }
-
-    while(true){
-
-        fb = esp_camera_fb_get();
-        if (!fb) {
-            Serial.println("Camera capture failed");
-            res = ESP_FAIL;
-        } else {
-            fr_start = esp_timer_get_time();
-            fr_ready = fr_start;
-            fr_face = fr_start;
-            fr_encode = fr_start;
-            fr_recognize = fr_start;
-            if(fb->width > 400){
-                if(fb->format != PIXFORMAT_JPEG){
-                    bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
-                    esp_camera_fb_return(fb);
-                    fb = NULL;
-                    if(!jpeg_converted){
-                        Serial.println("JPEG compression failed");
-                        res = ESP_FAIL;
-                    }
-                } else {
-                    _jpg_buf_len = fb->len;
-                    _jpg_buf = fb->buf;
-                }
-            } else {
-                image_matrix = dl_matrix3du_alloc(1, fb->width, fb->height, 3);
-
-                if (!image_matrix) {
-                    Serial.println("dl_matrix3du_alloc failed");
-                    res = ESP_FAIL;
-                } else {
-                    if(!fmt2rgb888(fb->buf, fb->len, fb->format, image_matrix->item)){
-                        Serial.println("fmt2rgb888 failed");
-                        res = ESP_FAIL;
-                    } else {
-                        
-                        fr_ready = esp_timer_get_time();
-                        //if (net_boxes || fb->format != PIXFORMAT_JPEG){
-                        if (true || fb->format != PIXFORMAT_JPEG){
-                            coffee_level(image_matrix);
-
-                            for(int i = 0; i < fb->height; i++){
-                              for(int i = 0; i < fb->width * 3; i = i + 3){
-  
-                                *(image_matrix->item + i) = *(image_matrix->item + i) - 25;
-                                
-                              }
-                            }                            
-
-                            if(!fmt2jpg(image_matrix->item, fb->width*fb->height*3, fb->width, fb->height, PIXFORMAT_RGB888, 90, &_jpg_buf, &_jpg_buf_len)){
-                                Serial.println("fmt2jpg failed");
-                                res = ESP_FAIL;
-                            }
-                            
-                            esp_camera_fb_return(fb);
-                            fb = NULL;
-                        } else {
-                            _jpg_buf = fb->buf;
-                            _jpg_buf_len = fb->len;
-                        }
-                        fr_encode = esp_timer_get_time();
-                    }
-                    dl_matrix3du_free(image_matrix);
-                }
-            }
-        }
-        if(res == ESP_OK){
-            size_t hlen = snprintf((char *)part_buf, 64, _STREAM_PART, _jpg_buf_len);
-            res = httpd_resp_send_chunk(req, (const char *)part_buf, hlen);
-        }
-        if(res == ESP_OK){
-            res = httpd_resp_send_chunk(req, (const char *)_jpg_buf, _jpg_buf_len);
-        }
-        if(res == ESP_OK){
-            res = httpd_resp_send_chunk(req, _STREAM_BOUNDARY, strlen(_STREAM_BOUNDARY));
-        }
-        
-        if(fb){
-            esp_camera_fb_return(fb);
-            fb = NULL;
-            _jpg_buf = NULL;
-        } else if(_jpg_buf){
-            free(_jpg_buf);
-            _jpg_buf = NULL;
-        }
-        if(res != ESP_OK){
-            break;
-        }
-        int64_t fr_end = esp_timer_get_time();
-
-        int64_t ready_time = (fr_ready - fr_start)/1000;
-        int64_t face_time = (fr_face - fr_ready)/1000;
-        int64_t recognize_time = (fr_recognize - fr_face)/1000;
-        int64_t encode_time = (fr_encode - fr_recognize)/1000;
-        int64_t process_time = (fr_encode - fr_start)/1000;
-        
-        int64_t frame_time = fr_end - last_frame;
-        last_frame = fr_end;
-        frame_time /= 1000;
-        uint32_t avg_frame_time = ra_filter_run(&ra_filter, frame_time);
-
-    }
-
-    last_frame = 0;
-    return res;
+    *len = _jpg_buf_len;
+    return _jpg_buf;
 }
 
 static esp_err_t cmd_handler(httpd_req_t *req){
-    
+    TRACE_SCOPE("control");
     char*  buf;
     size_t buf_len;
     char variable[32] = {0,};
@@ -628,147 +1033,14 @@ static esp_err_t cmd_handler(httpd_req_t *req){
     int val = atoi(value);
     sensor_t * s = esp_camera_sensor_get();
 
-    int res = 0;
-    if(!strcmp(variable, "framesize")) {
-      if(s->pixformat == PIXFORMAT_JPEG) res = s->set_framesize(s, (framesize_t)val);
-    }
-    else if(!strcmp(variable, "quality")){
-      EEPROM.write(1, val);
-      res = s->set_quality(s, val);
-    }
-    else if(!strcmp(variable, "contrast")){
-      EEPROM.write(2, val);
-      res = s->set_contrast(s, val);
-    }
-    else if(!strcmp(variable, "brightness")){
-      EEPROM.write(3, val);
-      res = s->set_brightness(s, val);
-    }
-    else if(!strcmp(variable, "saturation")){
-      EEPROM.write(4, val);
-      res = s->set_saturation(s, val);
-    }
-    else if(!strcmp(variable, "gainceiling")){
-      EEPROM.write(5, val);
-      res = s->set_gainceiling(s, (gainceiling_t)val);
-    }
-    else if(!strcmp(variable, "colorbar")){
-      EEPROM.write(6, val);
-      res = s->set_colorbar(s, val);
-    }
-    else if(!strcmp(variable, "awb")){
-      EEPROM.write(7, val);
-      res = s->set_whitebal(s, val);
-    }
-    /*else if(!strcmp(variable, "agc")){
-      EEPROM.write(8, val);
-      res = s->set_gain_ctrl(s, val);
-    }*/
-    else if(!strcmp(variable, "aec")){
-      EEPROM.write(9, val);
-      res = s->set_exposure_ctrl(s, val);
-    }
-    else if(!strcmp(variable, "hmirror")){
-      EEPROM.write(10, val);
-      res = s->set_hmirror(s, val);
-    }
-    else if(!strcmp(variable, "vflip")){
-      EEPROM.write(11, val);
-      res = s->set_vflip(s, val);
-    }
-    else if(!strcmp(variable, "awb_gain")){
-      EEPROM.write(12, val);
-      res = s->set_awb_gain(s, val);
-    }
-    else if(!strcmp(variable, "agc_gain")){
-      EEPROM.write(13, val);
-      res = s->set_agc_gain(s, val);
-    }
-    else if(!strcmp(variable, "aec_value")){
-      EEPROM.write(14, val);
-      res = s->set_aec_value(s, val);
-    }
-    else if(!strcmp(variable, "aec2")){
-      EEPROM.write(15, val);
-      res = s->set_aec2(s, val);
-    }
-    else if(!strcmp(variable, "dcw")){
-      EEPROM.write(16, val);
-      res = s->set_dcw(s, val);
-    }
-    /*else if(!strcmp(variable, "bpc")){
-      EEPROM.write(17, val);
-      res = s->set_bpc(s, val);
-    }
-    else if(!strcmp(variable, "wpc")){
-      EEPROM.write(18, val);
-      res = s->set_wpc(s, val);
-    }
-    else if(!strcmp(variable, "raw_gma")){
-      EEPROM.write(19, val);
-      res = s->set_raw_gma(s, val);
-    }
-    else if(!strcmp(variable, "lenc")){
-      EEPROM.write(20, val);
-      res = s->set_lenc(s, val);
-    }
-    else if(!strcmp(variable, "special_effect")){
-      EEPROM.write(21, val);
-      res = s->set_special_effect(s, val);
-    }
-    else if(!strcmp(variable, "wb_mode")){
-      EEPROM.write(22, val);
-      res = s->set_wb_mode(s, val);
-    }*/
-    else if(!strcmp(variable, "ae_level")){
-      EEPROM.write(23, val);
-      res = s->set_ae_level(s, val);
-    }
-
-    //Coffee Settings
-    else if(!strcmp(variable, "coffee_min")){
-      EEPROM.write(24, val);
-    }
-    else if(!strcmp(variable, "coffee_max")){
-      EEPROM.write(25, val);
-    }
-    else if(!strcmp(variable, "coffee_left")){
-      EEPROM.write(26, val);
-    }
-    else if(!strcmp(variable, "coffee_right")){
-      EEPROM.write(27, val);
-    }
-    else if(!strcmp(variable, "coffee_cups")){
-      EEPROM.write(17, val);
-    }
-    else if(!strcmp(variable, "coffee_text")){
-      EEPROM.write(18, val);
-    }
-    else if(!strcmp(variable, "coffee_obscure")){
-      EEPROM.write(19, val);
-    }
-    else if(!strcmp(variable, "coffee_potid")){
-      EEPROM.write(20, val);
-    }
-    else if(!strcmp(variable, "coffee_exists_x")){
-      EEPROM.write(21, val);
-    }
-    else if(!strcmp(variable, "coffee_exists_y")){
-      EEPROM.write(22, val);
-    }
-    else if(!strcmp(variable, "coffee_exists_threshold")){
-      EEPROM.write(8, val);
+    settings_set_result_t res = settings_set(s, variable, val);
+    if(res == SETTINGS_SET_UNKNOWN){
+        httpd_resp_send_404(req);
+        return ESP_FAIL;
     }
-    /*else if(!strcmp(variable, "face_detect")) {
-        detection_enabled = val;
-        if(!detection_enabled) {
-            recognition_enabled = 0;
-        }
-    } */   
+    settings_commit();
 
-    EEPROM.commit();
-    
-    if(res){
+    if(res != SETTINGS_SET_OK){
         return httpd_resp_send_500(req);
     }
 
@@ -777,52 +1049,101 @@ static esp_err_t cmd_handler(httpd_req_t *req){
 }
 
 static esp_err_t status_handler(httpd_req_t *req){
-    static char json_response[1024];
+    static char json_response[SETTINGS_JSON_MAX];
 
     sensor_t * s = esp_camera_sensor_get();
-    char * p = json_response;
-    *p++ = '{';
+    size_t len = settings_status_json(s, json_response);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    return httpd_resp_send(req, json_response, len);
+}
+
+// Quality gate verdicts of the measurement frames since boot, e.g.
+// {"accepted":120,"dark":3,"saturated":0,"blurred":1}
+static esp_err_t quality_handler(httpd_req_t *req){
+    char json_response[128];
+    char *p = json_response;
 
-    p+=sprintf(p, "\"framesize\":%u,", s->status.framesize);
-    p+=sprintf(p, "\"quality\":%u,", s->status.quality);
-    p+=sprintf(p, "\"brightness\":%d,", s->status.brightness);
-    p+=sprintf(p, "\"contrast\":%d,", s->status.contrast);
-    p+=sprintf(p, "\"saturation\":%d,", s->status.saturation);
-    //p+=sprintf(p, "\"special_effect\":%u,", s->status.special_effect);
-    //p+=sprintf(p, "\"wb_mode\":%u,", s->status.wb_mode);
-    p+=sprintf(p, "\"awb\":%u,", s->status.awb);
-    p+=sprintf(p, "\"awb_gain\":%u,", s->status.awb_gain);
-    p+=sprintf(p, "\"aec\":%u,", s->status.aec);
-    p+=sprintf(p, "\"aec2\":%u,", s->status.aec2);
-    p+=sprintf(p, "\"ae_level\":%d,", s->status.ae_level);
-    p+=sprintf(p, "\"aec_value\":%u,", s->status.aec_value);
-    //p+=sprintf(p, "\"agc\":%u,", s->status.agc);
-    p+=sprintf(p, "\"agc_gain\":%u,", s->status.agc_gain);
-    p+=sprintf(p, "\"gainceiling\":%u,", s->status.gainceiling);
-    p+=sprintf(p, "\"bpc\":%u,", s->status.bpc);
-    p+=sprintf(p, "\"wpc\":%u,", s->status.wpc);
-    p+=sprintf(p, "\"raw_gma\":%u,", s->status.raw_gma);
-    p+=sprintf(p, "\"lenc\":%u,", s->status.lenc);
-    p+=sprintf(p, "\"vflip\":%u,", s->status.vflip);
-    p+=sprintf(p, "\"hmirror\":%u,", s->status.hmirror);
-    p+=sprintf(p, "\"dcw\":%u,", s->status.dcw);
-    p+=sprintf(p, "\"colorbar\":%u,", s->status.colorbar);
-    p+=sprintf(p, "\"coffee_min\":%u,",     EEPROM.read(24)/*Max*/);
-    p+=sprintf(p, "\"coffee_max\":%u,",     EEPROM.read(25)/*Min*/);
-    p+=sprintf(p, "\"coffee_left\":%u,",    EEPROM.read(26)/*Left*/);
-    p+=sprintf(p, "\"coffee_right\":%u,",   EEPROM.read(27)/*Right*/);
-    p+=sprintf(p, "\"coffee_cups\":%u,",    EEPROM.read(17)/*Cups*/);
-    p+=sprintf(p, "\"coffee_text\":%u,",    EEPROM.read(18)/*Text*/);
-    p+=sprintf(p, "\"coffee_obscure\":%u,", EEPROM.read(19)/*Obscure*/);
-    p+=sprintf(p, "\"coffee_potid\":%u, ",    EEPROM.read(20)/*Pot ID*/);
-    p+=sprintf(p, "\"coffee_exists_x\":%u, ", EEPROM.read(21)/*Coffee Exists X*/);
-    p+=sprintf(p, "\"coffee_exists_y\":%u, ", EEPROM.read(22)/*Coffee Exists Y*/);
-    p+=sprintf(p, "\"coffee_exists_threshold\":%u", EEPROM.read(8)/*Coffee Exists Threshold*/);
+    *p++ = '{';
+    for(int i = 0; i < FRAME_QUALITY_REASONS; i++){
+        p += sprintf(p, "%s\"%s\":%u", i ? "," : "", frame_quality_reason_name((frame_quality_reason_t)i), burst.quality_count[i]);
+    }
     *p++ = '}';
-    *p++ = 0;
+    *p = 0;
     httpd_resp_set_type(req, "application/json");
     httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
-    return httpd_resp_send(req, json_response, strlen(json_response));
+    return httpd_resp_send(req, json_response, p - json_response);
+}
+
+typedef struct {
+    httpd_req_t *req;
+    size_t remaining;
+} analyze_request_t;
+
+static int analyze_read(void *ctx, uint8_t *buf, size_t len){
+    analyze_request_t *r = (analyze_request_t *)ctx;
+    if(!r->remaining){
+        return 0;
+    }
+    if(len > r->remaining){
+        len = r->remaining;
+    }
+    int n;
+    int retries = 0;
+    do {
+        n = httpd_req_recv(r->req, (char *)buf, len);
+    } while(n == HTTPD_SOCK_ERR_TIMEOUT && ++retries <= ANALYZE_RECV_RETRIES); //slow upload, wait a little
+    if(n < 0){
+        return -1;
+    }
+    r->remaining -= n;
+    return n;
+}
+
+static bool analyze_write(void *ctx, const char *text, size_t len){
+    return httpd_resp_send_chunk(((analyze_request_t *)ctx)->req, text, len) == ESP_OK;
+}
+
+// POST /analyze measures the JPEGs or /record stream in the body instead of
+// the camera, e.g. curl --data-binary @frame.jpg 'http://camera/analyze?dct_terms=8'.
+// Query parameters named like the settings in coffee_param_names override
+// the stored settings and the settings carried by recordings. Answers one
+// JSON line per frame as it goes, see coffee_analyze_stream().
+static esp_err_t analyze_handler(httpd_req_t *req){
+    TRACE_SCOPE("analyze");
+    coffee_params_t params = coffee_params();
+    coffee_analyze_buffers_t buffers = {0};
+    uint32_t fixed = 0;
+    char query[256];
+    char value[16];
+
+    if(httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK){
+        for(int i = 0; i < COFFEE_PARAM_COUNT; i++){
+            if(httpd_query_key_value(query, coffee_param_names[i], value, sizeof(value)) != ESP_OK){
+                continue;
+            }
+            const setting_t *setting = &settings_table[coffee_param_setting[i]];
+            int val = atoi(value);
+            if(val < setting->min || val > setting->max){
+                httpd_resp_set_status(req, "400 Bad Request");
+                return httpd_resp_send(req, coffee_param_names[i], strlen(coffee_param_names[i]));
+            }
+            params.value[i] = val;
+            fixed |= 1u << i;
+        }
+    }
+
+    analyze_request_t request = { req, req->content_len };
+    coffee_analyze_io_t io = { analyze_read, analyze_write, &request, NULL }; //DCT engine only, a BGR888 copy of a large JPEG would not fit
+    httpd_resp_set_type(req, "application/x-ndjson");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    int frames = coffee_analyze_stream(&io, &params, fixed, &buffers);
+    coffee_analyze_free(&buffers);
+    if(frames < 0){
+        static const char error[] = "{\"error\":\"unreadable input\"}\n";
+        httpd_resp_send_chunk(req, error, sizeof(error) - 1);
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 static esp_err_t index_handler(httpd_req_t *req){
@@ -832,7 +1153,6 @@ static esp_err_t index_handler(httpd_req_t *req){
 }
 
 void startCameraServer(){
-    EEPROM.begin(EEPROM_SIZE);
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 
     httpd_uri_t index_uri = {
@@ -863,12 +1183,28 @@ void startCameraServer(){
         .user_ctx  = NULL
     };
 
-   httpd_uri_t stream_uri = {
-        .uri       = "/stream",
+    httpd_uri_t quality_uri = {
+        .uri       = "/quality",
+        .method    = HTTP_GET,
+        .handler   = quality_handler,
+        .user_ctx  = NULL
+    };
+
+    httpd_uri_t analyze_uri = {
+        .uri       = "/analyze",
+        .method    = HTTP_POST,
+        .handler   = analyze_handler,
+        .user_ctx  = NULL
+    };
+
+#if TRACE_ENABLED
+    httpd_uri_t trace_uri = {
+        .uri       = "/trace",
         .method    = HTTP_GET,
-        .handler   = stream_handler,
+        .handler   = trace_handler,
         .user_ctx  = NULL
     };
+#endif
 
 
     ra_filter_init(&ra_filter, 20);
@@ -885,18 +1221,25 @@ void startCameraServer(){
     mtmn_config.o_threshold.candidate_number = 1;
     
     
+    if (!coffee_profile_start()) {
+        Serial.println("Profile workers failed to start");
+    }
+
     Serial.printf("Starting web server on port: '%d'\n", config.server_port);
     if (httpd_start(&camera_httpd, &config) == ESP_OK) {
         httpd_register_uri_handler(camera_httpd, &index_uri);
         httpd_register_uri_handler(camera_httpd, &cmd_uri);
         httpd_register_uri_handler(camera_httpd, &status_uri);
         httpd_register_uri_handler(camera_httpd, &capture_uri);
+        httpd_register_uri_handler(camera_httpd, &quality_uri);
+        httpd_register_uri_handler(camera_httpd, &analyze_uri);
+#if TRACE_ENABLED
+        httpd_register_uri_handler(camera_httpd, &trace_uri);
+#endif
     }
 
-    config.server_port += 1;
-    config.ctrl_port += 1;
-    Serial.printf("Starting stream server on port: '%d'\n", config.server_port);
-    if (httpd_start(&stream_httpd, &config) == ESP_OK) {
-        httpd_register_uri_handler(stream_httpd, &stream_uri);
+    Serial.printf("Starting stream server on port: '%d'\n", config.server_port + 1);
+    if (!stream_server_start(config.server_port + 1, stream_render)) {
+        Serial.println("Stream server failed to start");
     }
 }
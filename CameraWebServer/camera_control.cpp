@@ -0,0 +1,121 @@
+// Camera driver (re)initialization and capture format, see camera_control.h.
+#include "Arduino.h"
+#include "esp_timer.h"
+#include "camera_control.h"
+#include "settings.h"
+
+static camera_config_t camera_config;
+
+static portMUX_TYPE camera_mux = portMUX_INITIALIZER_UNLOCKED;
+static int camera_users = 0;
+static bool camera_paused = false;
+
+void camera_control_begin(const camera_config_t *config){
+    camera_config = *config;
+}
+
+pixformat_t camera_format(int format){
+    switch(format){
+        case CAMERA_FORMAT_GRAYSCALE:
+            return PIXFORMAT_GRAYSCALE;
+        case CAMERA_FORMAT_YUV422:
+            return PIXFORMAT_YUV422;
+        default:
+            return PIXFORMAT_JPEG;
+    }
+}
+
+int camera_format_index(pixformat_t pixformat){
+    switch(pixformat){
+        case PIXFORMAT_GRAYSCALE:
+            return CAMERA_FORMAT_GRAYSCALE;
+        case PIXFORMAT_YUV422:
+            return CAMERA_FORMAT_YUV422;
+        default:
+            return CAMERA_FORMAT_JPEG;
+    }
+}
+
+esp_err_t camera_control_init(){
+    camera_config_t config = camera_config;
+    int format = settings_read(SETTING_ID("pixformat"));
+
+    config.pixel_format = camera_format(format);
+    if(format == CAMERA_FORMAT_JPEG){
+        //init with high specs to pre-allocate larger buffers
+        if(psramFound()){
+            config.frame_size = FRAMESIZE_UXGA;
+            config.jpeg_quality = 10;
+            config.fb_count = 2;
+        } else {
+            config.frame_size = FRAMESIZE_SVGA;
+            config.jpeg_quality = 12;
+            config.fb_count = 1;
+        }
+    } else {
+        //raw buffers are sized for the frame, so init at the stored size
+        int framesize = settings_read(SETTING_ID("framesize"));
+        if(framesize > CAMERA_RAW_MAX_FRAMESIZE){
+            framesize = CAMERA_RAW_MAX_FRAMESIZE;
+            settings_write(SETTING_ID("framesize"), framesize);
+        }
+        config.frame_size = (framesize_t)framesize;
+        config.jpeg_quality = 12;
+        config.fb_count = psramFound() ? 2 : 1;
+    }
+
+    esp_err_t err = esp_camera_init(&config);
+    if (err != ESP_OK) {
+        Serial.printf("Camera init failed with error 0x%x\n", err);
+        return err;
+    }
+
+    //restore the stored sensor settings
+    settings_apply(esp_camera_sensor_get());
+    return ESP_OK;
+}
+
+esp_err_t camera_reconfigure(){
+    portENTER_CRITICAL(&camera_mux);
+    camera_paused = true;
+    portEXIT_CRITICAL(&camera_mux);
+
+    while(true){
+        portENTER_CRITICAL(&camera_mux);
+        int users = camera_users;
+        portEXIT_CRITICAL(&camera_mux);
+        if(!users){
+            break;
+        }
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+
+    int64_t start = esp_timer_get_time();
+    esp_camera_deinit();
+    esp_err_t err = camera_control_init();
+    Serial.printf("Camera reconfigured in %ums\n", (uint32_t)((esp_timer_get_time() - start)/1000));
+
+    portENTER_CRITICAL(&camera_mux);
+    camera_paused = false;
+    portEXIT_CRITICAL(&camera_mux);
+    return err;
+}
+
+void camera_acquire(){
+    while(true){
+        portENTER_CRITICAL(&camera_mux);
+        if(!camera_paused){
+            camera_users++;
+            portEXIT_CRITICAL(&camera_mux);
+            return;
+        }
+        portEXIT_CRITICAL(&camera_mux);
+        vTaskDelay(10 / portTICK_PERIOD_MS);
+    }
+}
+
+void camera_release(){
+    portENTER_CRITICAL(&camera_mux);
+    camera_users--;
+    portEXIT_CRITICAL(&camera_mux);
+}
@@ -0,0 +1,42 @@
+// Camera driver (re)initialization and capture format.
+//
+// The sensor runs either in JPEG (the stock configuration) or in a raw
+// format, GRAYSCALE or YUV422. In a raw format the measurement path reads
+// the Y plane directly with no decode, and JPEG is only produced in software
+// when a viewer asks for /stream or /capture, so the sensor never has to
+// switch formats per request.
+//
+// Changing the format, or the frame size of a raw format, needs a driver
+// reinit. camera_reconfigure() pauses new captures and waits for every
+// frame user (camera_acquire/camera_release) before it does so.
+#ifndef CAMERA_CONTROL_H_
+#define CAMERA_CONTROL_H_
+
+#include "esp_camera.h"
+
+// Values of the pixformat setting.
+#define CAMERA_FORMAT_JPEG      0
+#define CAMERA_FORMAT_GRAYSCALE 1
+#define CAMERA_FORMAT_YUV422    2
+
+// Largest frame size accepted in a raw format.
+#define CAMERA_RAW_MAX_FRAMESIZE FRAMESIZE_VGA
+
+// Keeps the pin and clock part of config for later reinits.
+void camera_control_begin(const camera_config_t *config);
+
+// Initializes the driver for the stored format and frame size, then applies
+// the stored sensor settings.
+esp_err_t camera_control_init();
+
+// Deinit + camera_control_init(), once no frame is in use.
+esp_err_t camera_reconfigure();
+
+// Bracket every esp_camera_fb_get()/esp_camera_fb_return() sequence.
+void camera_acquire();
+void camera_release();
+
+pixformat_t camera_format(int format);
+int camera_format_index(pixformat_t pixformat);
+
+#endif
@@ -0,0 +1,478 @@
+// Coffee level from a frame, see coffee_analyze.h.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "coffee_analyze.h"
+#include "frame_quality.h"
+#include "frame_scale.h"
+#include "jpeg_dct.h"
+#include "record_format.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+static int64_t coffee_analyze_now(){
+    return esp_timer_get_time();
+}
+#else
+#include <chrono>
+static int64_t coffee_analyze_now(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+const char *const coffee_param_names[COFFEE_PARAM_COUNT] = {
+    "coffee_min",
+    "coffee_max",
+    "coffee_left",
+    "coffee_right",
+    "coffee_exists_x",
+    "coffee_exists_y",
+    "coffee_exists_threshold",
+    "dct_terms",
+    "quality_dark",
+    "quality_saturated",
+    "quality_sharpness",
+    "analysis_scale",
+};
+
+int coffee_param_find(const char *name){
+    for(int i = 0; i < COFFEE_PARAM_COUNT; i++){
+        if(!strcmp(name, coffee_param_names[i])){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int coffee_clamp(int value, int low, int high){
+    return value < low ? low : value > high ? high : value;
+}
+
+coffee_geometry_t coffee_geometry_of(const coffee_params_t *params, int width, int height){
+    const int *v = params->value;
+    coffee_geometry_t g;
+    g.min_line_y = fabsf((float)height / 100 * v[COFFEE_PARAM_MIN] - height);
+    g.max_line_y = fabsf((float)height / 100 * v[COFFEE_PARAM_MAX] - height);
+    //the ROI bounds are exclusive, the exists marker has to be a pixel:
+    //100% would index one past the last column/row
+    g.left_line_x = coffee_clamp((float)width / 100 * v[COFFEE_PARAM_LEFT], 0, width);
+    g.right_line_x = coffee_clamp((float)width / 100 * v[COFFEE_PARAM_RIGHT], 0, width);
+    g.exists_x = coffee_clamp((float)width / 100 * v[COFFEE_PARAM_EXISTS_X], 0, width - 1);
+    g.exists_y = coffee_clamp((float)height / 100 * v[COFFEE_PARAM_EXISTS_Y], 0, height - 1);
+    return g;
+}
+
+coffee_reading_t coffee_reading_of(const coffee_params_t *params, int width, int height, int line_y, float exists_level){
+    coffee_geometry_t g = coffee_geometry_of(params, width, height);
+    coffee_reading_t reading;
+    reading.level = fabsf(((float)(line_y - g.max_line_y) / (float)(g.min_line_y - g.max_line_y) * 100) - 100);
+    reading.line_y = line_y;
+    reading.height = height;
+    reading.exists = exists_level > params->value[COFFEE_PARAM_EXISTS_THRESHOLD] ? 0 : 1;
+    return reading;
+}
+
+float coffee_confidence(const int *row_avg, int height, const coffee_peak_t *peak){
+    int other = 0;
+    if(!peak->strength){
+        return 0;
+    }
+    for(int i = COFFEE_PROFILE_MARGIN; i < height - COFFEE_PROFILE_MARGIN; i++){
+        if(abs(i - peak->line_y) < COFFEE_ANALYZE_SEPARATION){
+            continue;
+        }
+        int diff = abs(row_avg[i] - row_avg[i - 1]);
+        if(diff > other){
+            other = diff;
+        }
+    }
+    return 1.0f - (float)other / peak->strength;
+}
+
+void coffee_analyze_free(coffee_analyze_buffers_t *buffers){
+    free(buffers->data);
+    free(buffers->rows);
+    free(buffers->pixels);
+    free(buffers->decoded);
+    memset(buffers, 0, sizeof(*buffers));
+}
+
+static bool coffee_analyze_reserve(void **buf, size_t *size, size_t need){
+    if(*size >= need){
+        return true;
+    }
+    void *p = realloc(*buf, need);
+    if(!p){
+        return false;
+    }
+    *buf = p;
+    *size = need;
+    return true;
+}
+
+// Reads until at least need bytes of input are buffered.
+static bool coffee_analyze_fill(const coffee_analyze_io_t *io, coffee_analyze_buffers_t *b, size_t need){
+    if(need > COFFEE_ANALYZE_MAX_FRAME){
+        return false;
+    }
+    if(need > b->size){
+        size_t size = b->size ? b->size * 2 : 16 * 1024;
+        while(size < need){
+            size *= 2;
+        }
+        if(size > COFFEE_ANALYZE_MAX_FRAME){
+            size = COFFEE_ANALYZE_MAX_FRAME;
+        }
+        if(!coffee_analyze_reserve((void **)&b->data, &b->size, size)){
+            return false;
+        }
+    }
+    while(b->used < need){
+        int n = io->read(io->ctx, b->data + b->used, b->size - b->used);
+        if(n <= 0){
+            return false;
+        }
+        b->used += n;
+    }
+    return true;
+}
+
+static void coffee_analyze_consume(coffee_analyze_buffers_t *b, size_t len){
+    memmove(b->data, b->data + len, b->used - len);
+    b->used -= len;
+}
+
+// Length of the JPEG at the start of p: its EOI is the first marker after
+// the last scan that is neither a stuffed 0xFF nor a restart. 0 if more
+// input is needed, -1 if p is not a JPEG.
+static long coffee_jpeg_length(const uint8_t *p, size_t n){
+    size_t i = 2;
+    if(n < 2){
+        return 0;
+    }
+    if(p[0] != 0xFF || p[1] != 0xD8){
+        return -1;
+    }
+    while(true){
+        if(i + 2 > n){
+            return 0;
+        }
+        if(p[i] != 0xFF){
+            return -1;
+        }
+        int marker = p[i + 1];
+        if(marker == 0xFF){
+            i++;
+            continue;
+        }
+        if(marker == 0xD9){
+            return i + 2;
+        }
+        if(i + 4 > n){
+            return 0;
+        }
+        i += 2 + ((p[i + 2] << 8) | p[i + 3]);
+        if(marker != 0xDA){
+            continue;
+        }
+        //entropy coded data up to the next real marker
+        while(true){
+            const uint8_t *ff = (const uint8_t *)memchr(p + i, 0xFF, n > i ? n - i : 0);
+            if(!ff || ff + 1 >= p + n){
+                return 0;
+            }
+            i = ff - p;
+            int next = p[i + 1];
+            if(next == 0 || (next >= 0xD0 && next <= 0xD7)){
+                i += 2;
+                continue;
+            }
+            if(next == 0xFF){
+                i++;
+                continue;
+            }
+            break;
+        }
+    }
+}
+
+// Value of "name": in a settings JSON object, or -1.
+static int coffee_json_int(const char *json, size_t len, const char *name){
+    size_t name_len = strlen(name);
+    for(size_t i = 0; i + name_len + 3 < len; i++){
+        if(json[i] == '"' && !memcmp(json + i + 1, name, name_len) && json[i + name_len + 1] == '"' && json[i + name_len + 2] == ':'){
+            return atoi(json + i + name_len + 3);
+        }
+    }
+    return -1;
+}
+
+// One engine's reading of a frame.
+typedef struct {
+    int engine;             // ANALYSIS_ENGINE_DECODE or ANALYSIS_ENGINE_DCT
+    int width;              // analyzed frame size
+    int height;
+    coffee_reading_t reading;
+    float confidence;
+    frame_quality_reason_t quality;
+    uint32_t us;
+} coffee_measurement_t;
+
+typedef struct {
+    const char *error;      // NULL when measured
+    int count;              // 2 when a JPEG was measured by both engines
+    coffee_measurement_t m[2];
+} coffee_analysis_t;
+
+static void coffee_analyze_quality(const coffee_frame_t *frame, const coffee_params_t *params, coffee_measurement_t *m){
+    frame_quality_t quality;
+    frame_quality_limits_t limits = {
+        params->value[COFFEE_PARAM_QUALITY_DARK],
+        params->value[COFFEE_PARAM_QUALITY_SATURATED],
+        params->value[COFFEE_PARAM_QUALITY_SHARPNESS]
+    };
+    frame_quality_measure(frame, &quality);
+    m->quality = frame_quality_check(&quality, &limits);
+}
+
+// Whether a width x height frame can be profiled: at least one column, and
+// a row between the margins that can hold the coffee line.
+static bool coffee_analyze_measurable(int width, int height){
+    return width >= 1 && height >= 2 * COFFEE_PROFILE_MARGIN + 1;
+}
+
+// The decode engine: the frame's pixels (src_step bytes each, the first
+// channels of them kept) box filtered by analysis_scale, then
+// coffee_profile(). The exists marker reads the first channel, blue of
+// the device's BGR888.
+static const char *coffee_analyze_pixels(const uint8_t *data, int width, int height, int src_step, int channels,
+        const coffee_params_t *params, coffee_analyze_buffers_t *b, coffee_measurement_t *m){
+    int shift = coffee_clamp(params->value[COFFEE_PARAM_ANALYSIS_SCALE], 0, FRAME_SCALE_MAX_SHIFT);
+    const uint8_t *pixels = data;
+    if(!coffee_analyze_measurable(width >> shift, height >> shift)){
+        return "bad size";
+    }
+    if(src_step != channels || shift){
+        if(!coffee_analyze_reserve((void **)&b->pixels, &b->pixels_size, (size_t)(width >> shift) * (height >> shift) * channels)){
+            return "out of memory";
+        }
+        frame_downscale(data, width, height, src_step, channels, shift, b->pixels);
+        pixels = b->pixels;
+        width >>= shift;
+        height >>= shift;
+    }
+    coffee_geometry_t g = coffee_geometry_of(params, width, height);
+    coffee_frame_t frame = { pixels, width, height, channels, g.left_line_x, g.right_line_x };
+    coffee_peak_t peak = coffee_profile(&frame, b->rows, 1);
+    float exists_level = pixels[(g.exists_y * width + g.exists_x) * channels];
+    m->engine = ANALYSIS_ENGINE_DECODE;
+    m->width = width;
+    m->height = height;
+    m->reading = coffee_reading_of(params, width, height, peak.line_y, exists_level);
+    m->confidence = coffee_confidence(b->rows, height, &peak);
+    coffee_analyze_quality(&frame, params, m);
+    return NULL;
+}
+
+// The DCT engine, see jpeg_dct.h. The thumbnail stands in for the frame in
+// the quality gate, like on the device.
+static const char *coffee_analyze_dct(const uint8_t *data, size_t len, int width, int height,
+        const coffee_params_t *params, coffee_analyze_buffers_t *b, coffee_measurement_t *m){
+    int thumb_width = JPEG_DCT_THUMB_WIDTH(width);
+    int thumb_height = JPEG_DCT_THUMB_HEIGHT(height);
+    if(!coffee_analyze_measurable(thumb_width, thumb_height)){
+        return "bad size";
+    }
+    coffee_geometry_t g = coffee_geometry_of(params, width, height);
+    jpeg_dct_frame_t jpeg = { data, len, width, height, g.left_line_x, g.right_line_x, params->value[COFFEE_PARAM_DCT_TERMS] };
+    coffee_peak_t peak;
+    if(!coffee_analyze_reserve((void **)&b->pixels, &b->pixels_size, thumb_width * thumb_height)
+            || !jpeg_dct_profile(&jpeg, b->rows, b->pixels, &peak)){
+        return "unsupported JPEG";
+    }
+    float exists_level = b->pixels[(g.exists_y / 8) * thumb_width + g.exists_x / 8];
+    m->engine = ANALYSIS_ENGINE_DCT;
+    m->width = width;
+    m->height = height;
+    m->reading = coffee_reading_of(params, width, height, peak.line_y, exists_level);
+    m->confidence = coffee_confidence(b->rows, height, &peak);
+
+    coffee_geometry_t tg = coffee_geometry_of(params, thumb_width, thumb_height);
+    coffee_frame_t frame = { b->pixels, thumb_width, thumb_height, 1, tg.left_line_x, tg.right_line_x };
+    coffee_analyze_quality(&frame, params, m);
+    return NULL;
+}
+
+// Measures one frame. JPEG frames go through the DCT profile, and through
+// the decode engine as well when io has a decoder; raw frames through the
+// decode engine on their luma plane, like the device.
+static void coffee_analyze_frame(const coffee_analyze_io_t *io, const uint8_t *data, size_t len, int pixformat, int width, int height,
+        const coffee_params_t *params, coffee_analyze_buffers_t *b, coffee_analysis_t *out){
+    int64_t start = coffee_analyze_now();
+
+    memset(out, 0, sizeof(*out));
+    if(pixformat == RECORDER_PIXFORMAT_JPEG && !width && !jpeg_dct_size(data, len, &width, &height)){
+        out->error = "not a JPEG";
+        return;
+    }
+    if(width <= 0 || height <= 0 || !coffee_analyze_reserve((void **)&b->rows, &b->rows_size, height * sizeof(int))){
+        out->error = "bad size";
+        return;
+    }
+
+    if(pixformat == RECORDER_PIXFORMAT_JPEG){
+        out->error = coffee_analyze_dct(data, len, width, height, params, b, &out->m[0]);
+        if(out->error){
+            return;
+        }
+        out->m[0].us = coffee_analyze_now() - start;
+        out->count = 1;
+        if(!io->decode){
+            return;
+        }
+        start = coffee_analyze_now();
+        if(!coffee_analyze_reserve((void **)&b->decoded, &b->decoded_size, (size_t)width * height * 3)){
+            out->error = "out of memory";
+        } else if(!io->decode(io->ctx, data, len, width, height, b->decoded)){
+            out->error = "decode failed";
+        } else {
+            out->error = coffee_analyze_pixels(b->decoded, width, height, 3, 3, params, b, &out->m[1]);
+        }
+        if(out->error){
+            return;
+        }
+        out->m[1].us = coffee_analyze_now() - start;
+        out->count = 2;
+    } else if(pixformat == RECORDER_PIXFORMAT_GRAYSCALE || pixformat == RECORDER_PIXFORMAT_YUV422){
+        int step = pixformat == RECORDER_PIXFORMAT_YUV422 ? 2 : 1;
+        if(len < (size_t)width * height * step){
+            out->error = "short frame";
+            return;
+        }
+        out->error = coffee_analyze_pixels(data, width, height, step, 1, params, b, &out->m[0]);
+        if(out->error){
+            return;
+        }
+        out->m[0].us = coffee_analyze_now() - start;
+        out->count = 1;
+    } else {
+        out->error = "unsupported pixformat";
+    }
+}
+
+static const char *coffee_engine_name(int engine){
+    return engine == ANALYSIS_ENGINE_DCT ? "dct" : "decode";
+}
+
+// value with decimals digits, or null: JSON has no NaN or infinity, which
+// e.g. coffee_min equal to coffee_max makes of the level.
+static const char *coffee_json_float(char *text, size_t size, float value, int decimals){
+    if(!isfinite(value)){
+        return "null";
+    }
+    snprintf(text, size, "%.*f", decimals, value);
+    return text;
+}
+
+static int coffee_measurement_json(char *text, size_t size, const coffee_measurement_t *m){
+    char level[48];
+    char confidence[48];
+    return snprintf(text, size,
+        "\"width\":%d,\"height\":%d,\"engine\":\"%s\",\"level\":%s,\"line_y\":%d,\"exists\":%d,\"confidence\":%s,\"quality\":\"%s\",\"us\":%u",
+        m->width, m->height, coffee_engine_name(m->engine), coffee_json_float(level, sizeof(level), m->reading.level, 1),
+        m->reading.line_y, m->reading.exists, coffee_json_float(confidence, sizeof(confidence), m->confidence, 2),
+        frame_quality_reason_name(m->quality), (unsigned)m->us);
+}
+
+// recorded_engine is the engine the device measured the record with, -1
+// for plain JPEGs.
+static bool coffee_analyze_emit(const coffee_analyze_io_t *io, int index, const coffee_analysis_t *a, const recorder_header_t *record, int recorded_engine){
+    char line[640];
+    int n = snprintf(line, sizeof(line), "{\"frame\":%d", index);
+    if(record){
+        n += snprintf(line + n, sizeof(line) - n, ",\"sequence\":%u", (unsigned)record->sequence);
+        if(record->analyzed){
+            char level[48];
+            n += snprintf(line + n, sizeof(line) - n, ",\"recorded_level\":%s,\"recorded_engine\":\"%s\"",
+                coffee_json_float(level, sizeof(level), record->level, 1), coffee_engine_name(recorded_engine));
+        }
+    }
+    if(a->error){
+        n += snprintf(line + n, sizeof(line) - n, ",\"error\":\"%s\"", a->error);
+    }
+    if(a->count){
+        line[n++] = ',';
+        n += coffee_measurement_json(line + n, sizeof(line) - n, &a->m[0]);
+    }
+    if(a->count > 1){
+        n += snprintf(line + n, sizeof(line) - n, ",\"decode\":{");
+        n += coffee_measurement_json(line + n, sizeof(line) - n, &a->m[1]);
+        line[n++] = '}';
+    }
+    n += snprintf(line + n, sizeof(line) - n, "}\n");
+    return io->write(io->ctx, line, n);
+}
+
+int coffee_analyze_stream(const coffee_analyze_io_t *io, const coffee_params_t *params, uint32_t fixed, coffee_analyze_buffers_t *buffers){
+    coffee_analyze_buffers_t *b = buffers;
+    coffee_analysis_t analysis;
+    int frames = 0;
+
+    b->used = 0;
+    while(coffee_analyze_fill(io, b, 4)){
+        if(!memcmp(b->data, RECORDER_MAGIC, 4)){
+            recorder_header_t record;
+            if(!coffee_analyze_fill(io, b, sizeof(record))){
+                return -1;
+            }
+            memcpy(&record, b->data, sizeof(record));
+            //each length on its own first, so the sum cannot wrap a 32-bit size_t
+            if(record.header_len < sizeof(record) || record.settings_len > COFFEE_ANALYZE_MAX_FRAME
+                    || record.payload_len > COFFEE_ANALYZE_MAX_FRAME){
+                return -1;
+            }
+            size_t total = (size_t)record.header_len + record.settings_len + record.payload_len;
+            if(!coffee_analyze_fill(io, b, total)){
+                return -1;
+            }
+
+            coffee_params_t recorded = *params;
+            const char *json = (const char *)b->data + record.header_len;
+            for(int i = 0; i < COFFEE_PARAM_COUNT; i++){
+                int value = coffee_json_int(json, record.settings_len, coffee_param_names[i]);
+                if(value >= 0 && !(fixed & (1u << i))){
+                    recorded.value[i] = value;
+                }
+            }
+            //only JPEGs under analysis_engine 1 skipped the decode on the device
+            int engine = ANALYSIS_ENGINE_DECODE;
+            if(record.pixformat == RECORDER_PIXFORMAT_JPEG
+                    && coffee_json_int(json, record.settings_len, "analysis_engine") == ANALYSIS_ENGINE_DCT){
+                engine = ANALYSIS_ENGINE_DCT;
+            }
+            coffee_analyze_frame(io, b->data + record.header_len + record.settings_len, record.payload_len,
+                record.pixformat, record.width, record.height, &recorded, b, &analysis);
+            if(!coffee_analyze_emit(io, frames++, &analysis, &record, engine)){
+                return frames;
+            }
+            coffee_analyze_consume(b, total);
+        } else {
+            long len;
+            while(!(len = coffee_jpeg_length(b->data, b->used))){
+                if(!coffee_analyze_fill(io, b, b->used + 1)){
+                    return -1;
+                }
+            }
+            if(len < 0){
+                return -1;
+            }
+            coffee_analyze_frame(io, b->data, len, RECORDER_PIXFORMAT_JPEG, 0, 0, params, b, &analysis);
+            if(!coffee_analyze_emit(io, frames++, &analysis, NULL, -1)){
+                return frames;
+            }
+            coffee_analyze_consume(b, len);
+        }
+    }
+    return b->used ? -1 : frames;
+}
@@ -0,0 +1,138 @@
+// Coffee level from a frame, independent of the camera and the stored
+// settings, so the same code scores the device's own frames, frames posted
+// to /analyze and recordings replayed on a host (tools/analyze).
+//
+// Like coffee_profile.cpp this file has no Arduino dependencies.
+#ifndef COFFEE_ANALYZE_H_
+#define COFFEE_ANALYZE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "coffee_profile.h"
+
+// Analysis parameters, named like the settings they come from.
+typedef enum {
+    COFFEE_PARAM_MIN = 0,
+    COFFEE_PARAM_MAX,
+    COFFEE_PARAM_LEFT,
+    COFFEE_PARAM_RIGHT,
+    COFFEE_PARAM_EXISTS_X,
+    COFFEE_PARAM_EXISTS_Y,
+    COFFEE_PARAM_EXISTS_THRESHOLD,
+    COFFEE_PARAM_DCT_TERMS,
+    COFFEE_PARAM_QUALITY_DARK,
+    COFFEE_PARAM_QUALITY_SATURATED,
+    COFFEE_PARAM_QUALITY_SHARPNESS,
+    COFFEE_PARAM_ANALYSIS_SCALE,
+    COFFEE_PARAM_COUNT
+} coffee_param_t;
+
+extern const char *const coffee_param_names[COFFEE_PARAM_COUNT];
+
+// The settings defaults, for callers without stored settings.
+#define COFFEE_PARAM_DEFAULTS { 10, 90, 0, 100, 50, 50, 255, 4, 90, 50, 0, 0 }
+
+typedef struct {
+    int value[COFFEE_PARAM_COUNT];
+} coffee_params_t;
+
+// analysis_engine values: how the device measures JPEG frames. Raw frames
+// are always profiled from their pixels, like the decode engine does.
+#define ANALYSIS_ENGINE_DECODE 0
+#define ANALYSIS_ENGINE_DCT 1
+#define ANALYSIS_ENGINE_COMPARE 2   // both, the decode reading is used
+
+// Index of the named parameter, or -1.
+int coffee_param_find(const char *name);
+
+// ROI lines and exists marker in pixels of a width x height frame.
+typedef struct {
+    int min_line_y;
+    int max_line_y;
+    int left_line_x;
+    int right_line_x;
+    int exists_x;
+    int exists_y;
+} coffee_geometry_t;
+
+typedef struct {
+    float level;            // percent full, from the strongest horizontal edge
+    int line_y;             // row of that edge
+    int height;             // rows of the analyzed frame, to place line_y on a preview of another size
+    int exists;             // pot detected under the exists marker
+} coffee_reading_t;
+
+coffee_geometry_t coffee_geometry_of(const coffee_params_t *params, int width, int height);
+
+// Level and exists verdict of a width x height frame from its coffee line
+// row and the value under the exists marker.
+coffee_reading_t coffee_reading_of(const coffee_params_t *params, int width, int height, int line_y, float exists_level);
+
+// How much the coffee line stands out, 0-1: one minus the strongest other
+// row-to-row change at least COFFEE_ANALYZE_SEPARATION rows away, relative
+// to the line's own.
+#define COFFEE_ANALYZE_SEPARATION 8
+float coffee_confidence(const int *row_avg, int height, const coffee_peak_t *peak);
+
+// Buffers reused from frame to frame. Start zeroed, free with
+// coffee_analyze_free().
+typedef struct {
+    uint8_t *data;          // input being parsed
+    size_t size;
+    size_t used;
+    int *rows;
+    uint8_t *pixels;        // luma plane or DCT thumbnail
+    uint8_t *decoded;       // BGR888 from io->decode
+    size_t rows_size;
+    size_t pixels_size;
+    size_t decoded_size;
+} coffee_analyze_buffers_t;
+
+void coffee_analyze_free(coffee_analyze_buffers_t *buffers);
+
+typedef struct {
+    // Reads up to len bytes, returns the count, 0 at the end of the input or
+    // -1 on error.
+    int (*read)(void *ctx, uint8_t *buf, size_t len);
+    // Writes output text, returns false to stop.
+    bool (*write)(void *ctx, const char *text, size_t len);
+    void *ctx;
+    // Optional JPEG decoder for the decode engine: fills bgr with the
+    // frame as BGR888, like the device's fmt2rgb888(), or returns false if
+    // it is not width x height. Without one JPEGs are only measured in the
+    // DCT domain.
+    bool (*decode)(void *ctx, const uint8_t *jpeg, size_t len, int width, int height, uint8_t *bgr);
+} coffee_analyze_io_t;
+
+// Largest frame accepted on input.
+#ifdef ESP_PLATFORM
+#define COFFEE_ANALYZE_MAX_FRAME (512 * 1024)
+#else
+#define COFFEE_ANALYZE_MAX_FRAME (64 * 1024 * 1024)
+#endif
+
+// Analyzes every frame of the input and writes one JSON object per line:
+//
+//   {"frame":0,"width":400,"height":296,"engine":"dct","level":41.2,
+//    "line_y":171,"exists":1,"confidence":0.87,"quality":"accepted","us":812}
+//
+// width and height are those of the analyzed frame, after analysis_scale,
+// and line_y is a row of it. engine is how the frame was measured: JPEGs
+// in the DCT domain (jpeg_dct.h, "dct"), recorded GRAYSCALE/YUV422 frames
+// from their luma plane ("decode", the device's own path for raw frames).
+// With io->decode, JPEG objects also carry the decode engine's reading as
+// "decode":{"width":...,"engine":"decode",...,"us":...}.
+//
+// The input is one or more concatenated JPEGs, or a /record stream (see
+// record_format.h), whose objects also carry "sequence" and, for frames
+// the device measured, "recorded_level" and "recorded_engine". The device
+// measures JPEGs by decoding them unless analysis_engine was 1, so
+// recorded_level is only comparable with the reading of the same engine.
+// A host decoder is not the device's, so even that one can differ slightly.
+//
+// Records carry their own settings JSON, which replaces params except for
+// the parameters whose bit is set in fixed. Returns the number of frames,
+// or -1 if the input could not be parsed.
+int coffee_analyze_stream(const coffee_analyze_io_t *io, const coffee_params_t *params, uint32_t fixed, coffee_analyze_buffers_t *buffers);
+
+#endif
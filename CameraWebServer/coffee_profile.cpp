@@ -0,0 +1,219 @@
+// Row profile of the coffee ROI, see coffee_profile.h.
+#include <stdlib.h>
+#include "coffee_profile.h"
+
+typedef struct {
+    const coffee_frame_t *frame;
+    int *row_avg;
+    int row_begin;
+    int row_end;
+    coffee_peak_t peak;
+} coffee_slice_t;
+
+static int coffee_row_avg(const coffee_frame_t *frame, int row){
+    const uint8_t *p = frame->data + row * frame->width * frame->bytes_per_pixel;
+    int sum = 0;
+    for(int k = frame->left * frame->bytes_per_pixel; k < frame->right * frame->bytes_per_pixel; k++){
+        sum += p[k];
+    }
+    return sum / (frame->width * frame->bytes_per_pixel);
+}
+
+// Profiles rows [row_begin, row_end). The difference at row_begin needs the
+// row above, which belongs to the previous slice, so that one row is averaged
+// twice instead of reading row_avg while the other worker writes it.
+static void coffee_slice_run(coffee_slice_t *slice){
+    const coffee_frame_t *frame = slice->frame;
+    int first = slice->row_begin > COFFEE_PROFILE_MARGIN ? slice->row_begin : COFFEE_PROFILE_MARGIN;
+    int last = slice->row_end < frame->height - COFFEE_PROFILE_MARGIN ? slice->row_end : frame->height - COFFEE_PROFILE_MARGIN;
+    int h_last = slice->row_begin ? coffee_row_avg(frame, slice->row_begin - 1) : 0;
+
+    slice->peak.line_y = 0;
+    slice->peak.strength = 0;
+    for(int i = slice->row_begin; i < slice->row_end; i++){
+        int h_avg = coffee_row_avg(frame, i);
+        int diff = abs(h_avg - h_last);
+        slice->row_avg[i] = h_avg;
+        h_last = h_avg;
+        if(i >= first && i < last && diff > slice->peak.strength){
+            slice->peak.line_y = i;
+            slice->peak.strength = diff;
+        }
+    }
+}
+
+#ifdef ESP_PLATFORM
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+// One worker task pinned to each core. busy is taken for the duration of a
+// frame so stream_render() and the measurement loop never share the pool.
+// Created once by coffee_profile_start(), before either of them runs.
+static TaskHandle_t coffee_workers[COFFEE_PROFILE_MAX_WORKERS];
+static coffee_slice_t *coffee_jobs[COFFEE_PROFILE_MAX_WORKERS];
+static SemaphoreHandle_t coffee_done = NULL;
+static SemaphoreHandle_t coffee_busy = NULL;
+
+static void coffee_worker_task(void *arg){
+    int index = (int)(intptr_t)arg;
+    while(true){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        coffee_slice_run(coffee_jobs[index]);
+        xSemaphoreGive(coffee_done);
+    }
+}
+
+bool coffee_profile_start(){
+    if(coffee_busy){
+        return true;
+    }
+    coffee_done = xSemaphoreCreateCounting(COFFEE_PROFILE_MAX_WORKERS, 0);
+    SemaphoreHandle_t busy = xSemaphoreCreateMutex();
+    int started = 0;
+    if(coffee_done && busy){
+        while(started < COFFEE_PROFILE_MAX_WORKERS && xTaskCreatePinnedToCore(coffee_worker_task, "profile", 2048,
+                (void *)(intptr_t)started, 3, &coffee_workers[started], started) == pdPASS){
+            started++;
+        }
+    }
+    if(started < COFFEE_PROFILE_MAX_WORKERS){
+        while(started > 0){
+            vTaskDelete(coffee_workers[--started]);
+        }
+        if(coffee_done){
+            vSemaphoreDelete(coffee_done);
+            coffee_done = NULL;
+        }
+        if(busy){
+            vSemaphoreDelete(busy);
+        }
+        return false;
+    }
+    coffee_busy = busy;
+    return true;
+}
+
+static bool coffee_pool_run(coffee_slice_t *slices, int count){
+    if(!coffee_busy || xSemaphoreTake(coffee_busy, 0) != pdTRUE){
+        return false;
+    }
+    for(int i = 0; i < count; i++){
+        coffee_jobs[i] = &slices[i];
+        xTaskNotifyGive(coffee_workers[i]);
+    }
+    for(int i = 0; i < count; i++){
+        xSemaphoreTake(coffee_done, portMAX_DELAY);
+    }
+    xSemaphoreGive(coffee_busy);
+    return true;
+}
+
+#else
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Persistent host workers; a generation counter wakes them for each frame.
+// The workers never exit, so the mutex and condition variables are never
+// destroyed either: destroying a condition variable with waiters blocks exit().
+static std::mutex &coffee_mutex = *new std::mutex;
+static std::condition_variable &coffee_wake = *new std::condition_variable;
+static std::condition_variable &coffee_idle = *new std::condition_variable;
+static std::thread *coffee_threads[COFFEE_PROFILE_MAX_WORKERS];
+static coffee_slice_t *coffee_jobs[COFFEE_PROFILE_MAX_WORKERS];
+static unsigned coffee_generation = 0;
+static int coffee_job_count = 0;
+static int coffee_remaining = 0;
+static bool coffee_running = false;
+static bool coffee_started = false;
+
+static void coffee_worker_thread(int index){
+    unsigned seen = 0;
+    while(true){
+        coffee_slice_t *job;
+        {
+            std::unique_lock<std::mutex> lock(coffee_mutex);
+            coffee_wake.wait(lock, [&]{ return coffee_generation != seen && index < coffee_job_count; });
+            seen = coffee_generation;
+            job = coffee_jobs[index];
+        }
+        coffee_slice_run(job);
+        std::lock_guard<std::mutex> lock(coffee_mutex);
+        if(!--coffee_remaining){
+            coffee_idle.notify_one();
+        }
+    }
+}
+
+bool coffee_profile_start(){
+    std::lock_guard<std::mutex> lock(coffee_mutex);
+    if(!coffee_started){
+        for(int i = 0; i < COFFEE_PROFILE_MAX_WORKERS; i++){
+            coffee_threads[i] = new std::thread(coffee_worker_thread, i);
+            coffee_threads[i]->detach();
+        }
+        coffee_started = true;
+    }
+    return true;
+}
+
+static bool coffee_pool_run(coffee_slice_t *slices, int count){
+    std::unique_lock<std::mutex> lock(coffee_mutex);
+    if(!coffee_started || coffee_running){
+        return false;
+    }
+    coffee_running = true;
+    for(int i = 0; i < count; i++){
+        coffee_jobs[i] = &slices[i];
+    }
+    coffee_job_count = count;
+    coffee_remaining = count;
+    coffee_generation++;
+    coffee_wake.notify_all();
+    coffee_idle.wait(lock, []{ return coffee_remaining == 0; });
+    coffee_running = false;
+    return true;
+}
+
+#endif
+
+coffee_peak_t coffee_profile(const coffee_frame_t *frame, int *row_avg, int workers){
+    coffee_slice_t slices[COFFEE_PROFILE_MAX_WORKERS];
+
+    if(workers < 1){
+        workers = 1;
+    }
+    if(workers > COFFEE_PROFILE_MAX_WORKERS){
+        workers = COFFEE_PROFILE_MAX_WORKERS;
+    }
+    if(workers > frame->height){
+        workers = frame->height > 0 ? frame->height : 1;
+    }
+
+    for(int i = 0; i < workers; i++){
+        slices[i].frame = frame;
+        slices[i].row_avg = row_avg;
+        slices[i].row_begin = frame->height * i / workers;
+        slices[i].row_end = frame->height * (i + 1) / workers;
+    }
+
+    if(workers == 1 || !coffee_pool_run(slices, workers)){
+        slices[0].row_begin = 0;
+        slices[0].row_end = frame->height;
+        coffee_slice_run(&slices[0]);
+        return slices[0].peak;
+    }
+
+    // Slices are in row order and each keeps its first maximum, so taking
+    // the first strictly greater candidate matches the serial scan.
+    coffee_peak_t peak = slices[0].peak;
+    for(int i = 1; i < workers; i++){
+        if(slices[i].peak.strength > peak.strength){
+            peak = slices[i].peak;
+        }
+    }
+    return peak;
+}
@@ -0,0 +1,47 @@
+// Row profile of the coffee ROI: the average of every row between the left
+// and right lines, and the row with the strongest change from the row above
+// (the coffee line). The rows can be split across worker tasks, one per
+// ESP32 core; results are identical to the single-threaded pass.
+//
+// This file has no Arduino dependencies. Off target (no ESP_PLATFORM) the
+// workers are std::threads, so the same code can be profiled on a host.
+#ifndef COFFEE_PROFILE_H_
+#define COFFEE_PROFILE_H_
+
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#define COFFEE_PROFILE_MAX_WORKERS 2
+#else
+#define COFFEE_PROFILE_MAX_WORKERS 16
+#endif
+
+typedef struct {
+    const uint8_t *data;
+    int width;
+    int height;
+    int bytes_per_pixel;
+    int left;               // first column averaged
+    int right;              // one past the last column averaged
+} coffee_frame_t;
+
+typedef struct {
+    int line_y;             // row with the strongest change, 0 if none
+    int strength;           // |avg(line_y) - avg(line_y - 1)|
+} coffee_peak_t;
+
+// Starts the worker pool. Call once, from one task, before the first
+// profile with more than one worker; until it has succeeded every profile
+// runs on the calling task. Returns false (and leaves nothing behind) if a
+// worker could not be created.
+bool coffee_profile_start();
+
+// Fills row_avg (height entries) and returns the peak. Rows closer than
+// COFFEE_PROFILE_MARGIN to the top or bottom are not peak candidates.
+// workers is clamped to [1, COFFEE_PROFILE_MAX_WORKERS]; if the pool is busy
+// with another frame the call runs on the calling task instead of waiting.
+coffee_peak_t coffee_profile(const coffee_frame_t *frame, int *row_avg, int workers);
+
+#define COFFEE_PROFILE_MARGIN 5
+
+#endif
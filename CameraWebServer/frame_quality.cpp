@@ -0,0 +1,63 @@
+// Pre-analysis frame quality gate, see frame_quality.h.
+#include <stdlib.h>
+#include <string.h>
+#include "frame_quality.h"
+
+void frame_quality_measure(const coffee_frame_t *frame, frame_quality_t *quality){
+    int bpp = frame->bytes_per_pixel;
+    int channel = bpp == 3 ? 1 : 0;
+    int stride = frame->width * bpp;
+    int left = frame->left > 1 ? frame->left : 1;
+    int right = frame->right < frame->width ? frame->right : frame->width;
+    uint32_t sum = 0;
+    uint32_t gradient = 0;
+
+    memset(quality, 0, sizeof(*quality));
+    for(int y = 1; y < frame->height; y += FRAME_QUALITY_STEP){
+        const uint8_t *row = frame->data + y * stride + channel;
+        for(int x = left; x < right; x += FRAME_QUALITY_STEP){
+            const uint8_t *p = row + x * bpp;
+            int luma = *p;
+            quality->histogram[luma * FRAME_QUALITY_BINS / 256]++;
+            sum += luma;
+            gradient += abs(luma - p[-bpp]) + abs(luma - p[-stride]);
+            quality->samples++;
+        }
+    }
+    if(quality->samples){
+        quality->mean = sum / quality->samples;
+        quality->sharpness = gradient / quality->samples;
+    }
+}
+
+frame_quality_reason_t frame_quality_check(const frame_quality_t *quality, const frame_quality_limits_t *limits){
+    int samples = quality->samples;
+    if(!samples){
+        return FRAME_QUALITY_OK;
+    }
+    if(quality->histogram[0] * 100 > (uint32_t)(limits->dark_percent * samples)){
+        return FRAME_QUALITY_DARK;
+    }
+    if(quality->histogram[FRAME_QUALITY_BINS - 1] * 100 > (uint32_t)(limits->saturated_percent * samples)){
+        return FRAME_QUALITY_SATURATED;
+    }
+    if(quality->sharpness < limits->min_sharpness){
+        return FRAME_QUALITY_BLURRED;
+    }
+    return FRAME_QUALITY_OK;
+}
+
+const char *frame_quality_reason_name(frame_quality_reason_t reason){
+    switch(reason){
+        case FRAME_QUALITY_OK:
+            return "accepted";
+        case FRAME_QUALITY_DARK:
+            return "dark";
+        case FRAME_QUALITY_SATURATED:
+            return "saturated";
+        case FRAME_QUALITY_BLURRED:
+            return "blurred";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,45 @@
+// Pre-analysis frame quality gate. One sampled pass over the coffee ROI
+// builds a coarse luma histogram and a sharpness estimate, so frames that
+// are black (mid auto-exposure), blown out or motion blurred can be dropped
+// before they are measured and reported.
+//
+// Like coffee_profile.cpp this file has no Arduino dependencies.
+#ifndef FRAME_QUALITY_H_
+#define FRAME_QUALITY_H_
+
+#include <stdint.h>
+#include "coffee_profile.h"
+
+#define FRAME_QUALITY_BINS 16
+#define FRAME_QUALITY_STEP 4    // every 4th row and column of the ROI is sampled
+
+typedef enum {
+    FRAME_QUALITY_OK = 0,
+    FRAME_QUALITY_DARK,         // too many samples in the lowest bin
+    FRAME_QUALITY_SATURATED,    // too many samples in the highest bin
+    FRAME_QUALITY_BLURRED,      // mean gradient below the limit
+    FRAME_QUALITY_REASONS
+} frame_quality_reason_t;
+
+typedef struct {
+    uint32_t histogram[FRAME_QUALITY_BINS];
+    int samples;
+    int mean;                   // luma 0-255
+    int sharpness;              // mean |dx| + |dy| at the sampled pixels
+} frame_quality_t;
+
+typedef struct {
+    int dark_percent;           // 100 disables
+    int saturated_percent;      // 100 disables
+    int min_sharpness;          // 0 disables
+} frame_quality_limits_t;
+
+// Luma is the byte itself for 1 byte per pixel frames and green for BGR888.
+void frame_quality_measure(const coffee_frame_t *frame, frame_quality_t *quality);
+
+// First limit the frame fails, or FRAME_QUALITY_OK.
+frame_quality_reason_t frame_quality_check(const frame_quality_t *quality, const frame_quality_limits_t *limits);
+
+const char *frame_quality_reason_name(frame_quality_reason_t reason);
+
+#endif
@@ -0,0 +1,35 @@
+// Integer box-filter downscaling, see frame_scale.h.
+#include "frame_scale.h"
+
+void frame_downscale(const uint8_t *src, int width, int height, int src_step, int channels, int shift, uint8_t *dst){
+    int factor = 1 << shift;
+    int out_width = width >> shift;
+    int out_height = height >> shift;
+    int stride = width * src_step;
+
+    if(!shift){
+        for(int i = 0; i < width * height; i++){
+            for(int c = 0; c < channels; c++){
+                *dst++ = src[i * src_step + c];
+            }
+        }
+        return;
+    }
+
+    for(int oy = 0; oy < out_height; oy++){
+        const uint8_t *block_row = src + oy * factor * stride;
+        for(int ox = 0; ox < out_width; ox++){
+            const uint8_t *block = block_row + ox * factor * src_step;
+            for(int c = 0; c < channels; c++){
+                uint32_t sum = 0;
+                for(int dy = 0; dy < factor; dy++){
+                    const uint8_t *p = block + dy * stride + c;
+                    for(int dx = 0; dx < factor; dx++){
+                        sum += p[dx * src_step];
+                    }
+                }
+                *dst++ = sum >> (2 * shift);
+            }
+        }
+    }
+}
@@ -0,0 +1,17 @@
+// Integer box-filter downscaling, used to give analysis and the /stream
+// preview their own resolution independent of the sensor frame size.
+#ifndef FRAME_SCALE_H_
+#define FRAME_SCALE_H_
+
+#include <stdint.h>
+
+// Largest supported shift (1/8 scale).
+#define FRAME_SCALE_MAX_SHIFT 3
+
+// Averages 2^shift x 2^shift blocks of src into dst, which must hold
+// (width >> shift) * (height >> shift) * channels bytes. Each source pixel is
+// src_step bytes and its first channels bytes are kept, so the Y plane of a
+// YUYV frame is src_step 2, channels 1. Leftover columns/rows are dropped.
+void frame_downscale(const uint8_t *src, int width, int height, int src_step, int channels, int shift, uint8_t *dst);
+
+#endif
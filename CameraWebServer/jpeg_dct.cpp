@@ -0,0 +1,491 @@
+// Compressed-domain row profile of a JPEG frame, see jpeg_dct.h.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg_dct.h"
+
+#define JPEG_DCT_FAST_BITS 9
+#define JPEG_DCT_MAX_COMPONENTS 3
+
+// Zigzag index of F(0,v), the coefficients with no horizontal frequency.
+static const uint8_t jpeg_dct_zigzag_v[JPEG_DCT_MAX_TERMS] = { 0, 2, 3, 9, 10, 20, 21, 35 };
+
+// 1024 * C(v) * cos((2y+1) v pi / 16) / (4 sqrt(2)): the mean of pixel row y
+// of a block is 128 + sum_v F(0,v) * basis[y][v] / 1024.
+static const int16_t jpeg_dct_basis[8][JPEG_DCT_MAX_TERMS] = {
+    { 128,  178,  167,  151,  128,  101,   69,   35},
+    { 128,  151,   69,  -35, -128, -178, -167, -101},
+    { 128,  101,  -69, -178, -128,   35,  167,  151},
+    { 128,   35, -167, -101,  128,  151,  -69, -178},
+    { 128,  -35, -167,  101,  128, -151,  -69,  178},
+    { 128, -101,  -69,  178, -128,  -35,  167, -151},
+    { 128, -151,   69,   35, -128,  178, -167,  101},
+    { 128, -178,  167, -151,  128, -101,   69,  -35},
+};
+
+typedef struct {
+    uint16_t fast[1 << JPEG_DCT_FAST_BITS];     // (length << 8) | symbol, 0 if the code is longer
+    int16_t fast_ac[1 << JPEG_DCT_FAST_BITS];   // (value << 8) | (run << 4) | code+value length, 0 if longer
+    int32_t maxcode[18];
+    int32_t mincode[17];
+    uint8_t valptr[17];
+    uint8_t values[256];
+    bool defined;
+} jpeg_dct_huffman_t;
+
+typedef struct {
+    int id;
+    int h;
+    int v;
+    int tq;
+    int td;
+    int ta;
+    int pred;
+} jpeg_dct_component_t;
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t bits;
+    int count;
+    bool marker;            // hit a marker, feeding zeros
+} jpeg_dct_reader_t;
+
+typedef struct {
+    jpeg_dct_huffman_t dc[4];
+    jpeg_dct_huffman_t ac[4];
+    uint8_t quant[4][64];   // zigzag order
+    jpeg_dct_component_t comp[JPEG_DCT_MAX_COMPONENTS];
+    int ncomp;
+    int width;
+    int height;
+    int restart_interval;
+    jpeg_dct_reader_t in;
+} jpeg_dct_t;
+
+static void jpeg_dct_refill(jpeg_dct_reader_t *in){
+    while(in->count <= 24){
+        uint32_t b = 0;
+        if(!in->marker && in->p < in->end){
+            b = *in->p++;
+            if(b == 0xFF){
+                if(in->p < in->end && *in->p == 0){
+                    in->p++;
+                } else {
+                    in->p--;
+                    in->marker = true;
+                    b = 0;
+                }
+            }
+        }
+        in->bits |= b << (24 - in->count);
+        in->count += 8;
+    }
+}
+
+// Makes sure at least 16 bits are buffered.
+static inline void jpeg_dct_fill(jpeg_dct_reader_t *in){
+    if(in->count < 16){
+        jpeg_dct_refill(in);
+    }
+}
+
+static inline uint32_t jpeg_dct_bits(jpeg_dct_reader_t *in, int n){
+    uint32_t v = in->bits >> (32 - n);
+    in->bits <<= n;
+    in->count -= n;
+    return v;
+}
+
+static inline int jpeg_dct_extend(uint32_t v, int s){
+    return v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+// Returns the symbol, or -1 for a code that is not in the table.
+static inline int jpeg_dct_decode(jpeg_dct_reader_t *in, const jpeg_dct_huffman_t *h){
+    jpeg_dct_fill(in);
+    uint16_t f = h->fast[in->bits >> (32 - JPEG_DCT_FAST_BITS)];
+    if(f){
+        jpeg_dct_bits(in, f >> 8);
+        return f & 0xFF;
+    }
+    for(int l = JPEG_DCT_FAST_BITS + 1; l <= 16; l++){
+        int32_t code = in->bits >> (32 - l);
+        if(code <= h->maxcode[l]){
+            jpeg_dct_bits(in, l);
+            return h->values[h->valptr[l] + code - h->mincode[l]];
+        }
+    }
+    return -1;
+}
+
+static bool jpeg_dct_build(jpeg_dct_huffman_t *h, const uint8_t *counts, const uint8_t *values, int total){
+    int code = 0;
+    int k = 0;
+
+    memset(h->fast, 0, sizeof(h->fast));
+    memcpy(h->values, values, total);
+    for(int l = 1; l <= 16; l++){
+        h->valptr[l] = k;
+        h->mincode[l] = code;
+        for(int i = 0; i < counts[l - 1]; i++, k++, code++){
+            if(code >= (1 << l)){
+                return false;
+            }
+            if(l <= JPEG_DCT_FAST_BITS){
+                int shift = JPEG_DCT_FAST_BITS - l;
+                for(int j = 0; j < (1 << shift); j++){
+                    h->fast[(code << shift) | j] = (l << 8) | values[k];
+                }
+            }
+        }
+        h->maxcode[l] = counts[l - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+    h->maxcode[17] = INT32_MAX;
+    h->defined = true;
+
+    //AC codes whose value bits also fit in the lookup are decoded in one step
+    memset(h->fast_ac, 0, sizeof(h->fast_ac));
+    for(int i = 0; i < (1 << JPEG_DCT_FAST_BITS); i++){
+        uint16_t f = h->fast[i];
+        int l = f >> 8;
+        int run = (f >> 4) & 15;
+        int size = f & 15;
+        if(f && size && l + size <= JPEG_DCT_FAST_BITS){
+            uint32_t v = (i >> (JPEG_DCT_FAST_BITS - l - size)) & ((1 << size) - 1);
+            int value = jpeg_dct_extend(v, size);
+            if(value >= -128 && value <= 127){
+                h->fast_ac[i] = value * 256 + (run << 4) + l + size;
+            }
+        }
+    }
+    return true;
+}
+
+static int jpeg_dct_u16(const uint8_t *p){
+    return (p[0] << 8) | p[1];
+}
+
+// Parses up to and including SOS and leaves the reader at the entropy data.
+static bool jpeg_dct_header(jpeg_dct_t *d, const uint8_t *p, const uint8_t *end){
+    if(end - p < 4 || p[0] != 0xFF || p[1] != 0xD8){
+        return false;
+    }
+    p += 2;
+    bool frame = false;
+    while(end - p >= 4){
+        if(p[0] != 0xFF){
+            return false;
+        }
+        int marker = p[1];
+        if(marker == 0xFF){
+            p++;
+            continue;
+        }
+        int len = jpeg_dct_u16(p + 2);
+        const uint8_t *seg = p + 4;
+        const uint8_t *seg_end = p + 2 + len;
+        if(len < 2 || seg_end > end){
+            return false;
+        }
+
+        if(marker == 0xDB){                                 //DQT
+            while(seg_end - seg >= 65){
+                int pq = seg[0] >> 4;
+                int tq = seg[0] & 15;
+                if(tq > 3 || (pq && seg_end - seg < 129)){
+                    return false;
+                }
+                for(int i = 0; i < 64; i++){
+                    int q = pq ? jpeg_dct_u16(seg + 1 + 2 * i) : seg[1 + i];
+                    d->quant[tq][i] = q > 255 ? 255 : q;
+                }
+                seg += pq ? 129 : 65;
+            }
+        } else if(marker == 0xC4){                          //DHT
+            while(seg_end - seg >= 17){
+                int tc = seg[0] >> 4;
+                int th = seg[0] & 15;
+                int total = 0;
+                for(int i = 0; i < 16; i++){
+                    total += seg[1 + i];
+                }
+                if(tc > 1 || th > 3 || total > 256 || seg_end - seg < 17 + total){
+                    return false;
+                }
+                jpeg_dct_huffman_t *h = tc ? &d->ac[th] : &d->dc[th];
+                if(!jpeg_dct_build(h, seg + 1, seg + 17, total)){
+                    return false;
+                }
+                seg += 17 + total;
+            }
+        } else if(marker == 0xC0 || marker == 0xC1){        //SOF0/SOF1
+            if(len < 8 || seg[0] != 8){
+                return false;
+            }
+            d->height = jpeg_dct_u16(seg + 1);
+            d->width = jpeg_dct_u16(seg + 3);
+            d->ncomp = seg[5];
+            if(d->ncomp < 1 || d->ncomp > JPEG_DCT_MAX_COMPONENTS || len < 8 + 3 * d->ncomp){
+                return false;
+            }
+            for(int i = 0; i < d->ncomp; i++){
+                d->comp[i].id = seg[6 + 3 * i];
+                d->comp[i].h = seg[7 + 3 * i] >> 4;
+                d->comp[i].v = seg[7 + 3 * i] & 15;
+                d->comp[i].tq = seg[8 + 3 * i] & 3;
+                if(d->comp[i].h < 1 || d->comp[i].h > 4 || d->comp[i].v < 1 || d->comp[i].v > 4){
+                    return false;
+                }
+            }
+            frame = true;
+        } else if(marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC){
+            return false;                                   //progressive, lossless or arithmetic
+        } else if(marker == 0xDD){                          //DRI
+            if(len < 4){
+                return false;
+            }
+            d->restart_interval = jpeg_dct_u16(seg);
+        } else if(marker == 0xDA){                          //SOS
+            //only a single interleaved scan carrying every component
+            if(!frame || len < 6 + 2 * d->ncomp || seg[0] != d->ncomp){
+                return false;
+            }
+            for(int i = 0; i < d->ncomp; i++){
+                if(seg[1 + 2 * i] != d->comp[i].id){
+                    return false;
+                }
+                d->comp[i].td = seg[2 + 2 * i] >> 4;
+                d->comp[i].ta = seg[2 + 2 * i] & 15;
+                if(d->comp[i].td > 3 || d->comp[i].ta > 3 || !d->dc[d->comp[i].td].defined || !d->ac[d->comp[i].ta].defined){
+                    return false;
+                }
+            }
+            d->in.p = seg_end;
+            d->in.end = end;
+            return true;
+        }
+        p = seg_end;
+    }
+    return false;
+}
+
+// Decodes one block. Coefficients at zigzag positions below keep are stored
+// in coef (dequantization is left to the caller), the rest only skipped.
+static bool jpeg_dct_block(jpeg_dct_t *d, jpeg_dct_component_t *c, int *coef, int keep){
+    jpeg_dct_reader_t *in = &d->in;
+
+    int s = jpeg_dct_decode(in, &d->dc[c->td]);
+    if(s < 0 || s > 11){
+        return false;
+    }
+    if(s){
+        jpeg_dct_fill(in);
+        c->pred += jpeg_dct_extend(jpeg_dct_bits(in, s), s);
+    }
+    coef[0] = c->pred;
+    for(int k = 1; k < keep; k++){
+        coef[k] = 0;
+    }
+
+    const jpeg_dct_huffman_t *ac = &d->ac[c->ta];
+    for(int k = 1; k < 64; k++){
+        jpeg_dct_fill(in);
+        int fast = ac->fast_ac[in->bits >> (32 - JPEG_DCT_FAST_BITS)];
+        if(fast){
+            jpeg_dct_bits(in, fast & 15);
+            k += (fast >> 4) & 15;
+            if(k < keep){
+                coef[k] = fast >> 8;
+            }
+            continue;
+        }
+        int rs = jpeg_dct_decode(in, ac);
+        if(rs < 0){
+            return false;
+        }
+        int r = rs >> 4;
+        s = rs & 15;
+        if(!s){
+            if(r != 15){
+                break;                                      //EOB
+            }
+            k += 15;                                        //ZRL
+            continue;
+        }
+        k += r;
+        jpeg_dct_fill(in);
+        uint32_t v = jpeg_dct_bits(in, s);
+        if(k < keep){
+            coef[k] = jpeg_dct_extend(v, s);
+        }
+    }
+    return true;
+}
+
+static bool jpeg_dct_restart(jpeg_dct_t *d){
+    jpeg_dct_reader_t *in = &d->in;
+    if(in->end - in->p < 2 || in->p[0] != 0xFF || (in->p[1] & 0xF8) != 0xD0){
+        return false;
+    }
+    in->p += 2;
+    in->bits = 0;
+    in->count = 0;
+    in->marker = false;
+    for(int i = 0; i < d->ncomp; i++){
+        d->comp[i].pred = 0;
+    }
+    return true;
+}
+
+bool jpeg_dct_size(const uint8_t *data, size_t len, int *width, int *height){
+    const uint8_t *p = data + 2;
+    const uint8_t *end = data + len;
+    if(len < 4 || data[0] != 0xFF || data[1] != 0xD8){
+        return false;
+    }
+    while(end - p >= 9 && p[0] == 0xFF){
+        int marker = p[1];
+        if(marker == 0xFF){
+            p++;
+            continue;
+        }
+        if(marker == 0xC0 || marker == 0xC1 || marker == 0xC2){
+            *height = jpeg_dct_u16(p + 5);
+            *width = jpeg_dct_u16(p + 7);
+            return true;
+        }
+        if(marker == 0xDA){
+            return false;
+        }
+        p += 2 + jpeg_dct_u16(p + 2);
+    }
+    return false;
+}
+
+bool jpeg_dct_profile(const jpeg_dct_frame_t *frame, int *row_avg, uint8_t *thumb, coffee_peak_t *peak){
+    jpeg_dct_t *d = (jpeg_dct_t *)calloc(1, sizeof(jpeg_dct_t));
+    if(!d){
+        return false;
+    }
+    if(!jpeg_dct_header(d, frame->data, frame->data + frame->len) || d->width != frame->width || d->height != frame->height){
+        free(d);
+        return false;
+    }
+
+    int terms = frame->terms < 1 ? 1 : frame->terms > JPEG_DCT_MAX_TERMS ? JPEG_DCT_MAX_TERMS : frame->terms;
+    int keep = jpeg_dct_zigzag_v[terms - 1] + 1;
+    int hmax = 1;
+    int vmax = 1;
+    for(int i = 0; i < d->ncomp; i++){
+        hmax = d->comp[i].h > hmax ? d->comp[i].h : hmax;
+        vmax = d->comp[i].v > vmax ? d->comp[i].v : vmax;
+    }
+    //luma must have the full resolution
+    bool ok = d->comp[0].h == hmax && d->comp[0].v == vmax;
+
+    int blocks_x = JPEG_DCT_THUMB_WIDTH(d->width);
+    int blocks_y = JPEG_DCT_THUMB_HEIGHT(d->height);
+    int roi_first = frame->left / 8;
+    int roi_last = (frame->right - 1) / 8;
+    if(roi_last >= blocks_x){
+        roi_last = blocks_x - 1;
+    }
+    if(roi_first > roi_last){
+        roi_first = roi_last = 0;
+    }
+    int roi_blocks = roi_last - roi_first + 1;
+
+    //basis scaled by the luma quantizers, so blocks need no dequantization
+    int32_t weight[8][JPEG_DCT_MAX_TERMS];
+    const uint8_t *q = d->quant[d->comp[0].tq];
+    for(int y = 0; y < 8; y++){
+        for(int v = 0; v < terms; v++){
+            weight[y][v] = jpeg_dct_basis[y][v] * q[jpeg_dct_zigzag_v[v]];
+        }
+    }
+
+    int mcus_x, mcus_y, mcu_h, mcu_v;
+    if(d->ncomp == 1){
+        //a single component scan is not interleaved, one block per MCU
+        mcus_x = blocks_x;
+        mcus_y = blocks_y;
+        mcu_h = mcu_v = 1;
+    } else {
+        mcus_x = (d->width + 8 * hmax - 1) / (8 * hmax);
+        mcus_y = (d->height + 8 * vmax - 1) / (8 * vmax);
+        mcu_h = d->comp[0].h;
+        mcu_v = d->comp[0].v;
+    }
+
+    //row sums of one MCU row of luma blocks
+    int64_t *sums = (int64_t *)calloc(8 * mcu_v, sizeof(int64_t));
+    ok = ok && sums;
+
+    int coef[64];
+    int mcu = 0;
+    for(int my = 0; ok && my < mcus_y; my++){
+        memset(sums, 0, 8 * mcu_v * sizeof(int64_t));
+        for(int mx = 0; ok && mx < mcus_x; mx++, mcu++){
+            if(d->restart_interval && mcu && mcu % d->restart_interval == 0){
+                ok = jpeg_dct_restart(d);
+            }
+            for(int ci = 0; ok && ci < d->ncomp; ci++){
+                jpeg_dct_component_t *c = &d->comp[ci];
+                int bh = d->ncomp == 1 ? 1 : c->h;
+                int bv = d->ncomp == 1 ? 1 : c->v;
+                for(int by = 0; ok && by < bv; by++){
+                    for(int bx = 0; ok && bx < bh; bx++){
+                        if(ci){
+                            ok = jpeg_dct_block(d, c, coef, 1);
+                            continue;
+                        }
+                        int block_x = mx * mcu_h + bx;
+                        int block_y = my * mcu_v + by;
+                        bool roi = block_x >= roi_first && block_x <= roi_last;
+                        ok = jpeg_dct_block(d, c, coef, roi ? keep : 1);
+                        if(!ok || block_x >= blocks_x || block_y >= blocks_y){
+                            continue;
+                        }
+                        if(thumb){
+                            int mean = 128 + (coef[0] * q[0] + (coef[0] < 0 ? -4 : 4)) / 8;
+                            thumb[block_y * blocks_x + block_x] = mean < 0 ? 0 : mean > 255 ? 255 : mean;
+                        }
+                        if(roi){
+                            int64_t *row = sums + by * 8;
+                            for(int y = 0; y < 8; y++){
+                                int32_t acc = 0;
+                                for(int v = 0; v < terms; v++){
+                                    acc += weight[y][v] * coef[jpeg_dct_zigzag_v[v]];
+                                }
+                                row[y] += acc;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        for(int y = 0; ok && y < 8 * mcu_v; y++){
+            int row = my * 8 * mcu_v + y;
+            if(row < d->height){
+                row_avg[row] = 128 + (int)(sums[y] / (roi_blocks * 1024));
+            }
+        }
+    }
+
+    if(ok){
+        //same scan as coffee_profile(): first strongest change inside the margin
+        peak->line_y = 0;
+        peak->strength = 0;
+        for(int i = COFFEE_PROFILE_MARGIN; i < d->height - COFFEE_PROFILE_MARGIN; i++){
+            int diff = abs(row_avg[i] - row_avg[i - 1]);
+            if(diff > peak->strength){
+                peak->line_y = i;
+                peak->strength = diff;
+            }
+        }
+    }
+    free(sums);
+    free(d);
+    return ok;
+}
@@ -0,0 +1,52 @@
+// Compressed-domain row profile of a JPEG frame.
+//
+// The coffee line is a horizontal edge, so only the average of each pixel
+// row inside the ROI matters. Averaging an 8x8 block over x cancels every
+// DCT term with a horizontal frequency, which leaves the DC and the vertical
+// AC coefficients F(0,v). jpeg_dct_profile() entropy decodes the frame and
+// rebuilds the ROI row averages from those coefficients of the luma blocks
+// between the left and right lines. It does no IDCT, chroma or color
+// conversion. With terms = 8 the row averages are exact; fewer terms give
+// a vertically low-passed profile.
+//
+// Huffman coding is sequential, so every block's codes are still walked to
+// find the next one; blocks outside the ROI and chroma blocks only have
+// their bits skipped.
+//
+// Supports baseline and extended sequential Huffman JPEG (SOF0/SOF1, 8 bit)
+// with luma as the first component, which is what the esp32-camera sensors
+// produce. Like coffee_profile.cpp this file has no Arduino dependencies.
+#ifndef JPEG_DCT_H_
+#define JPEG_DCT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "coffee_profile.h"
+
+#define JPEG_DCT_MAX_TERMS 8
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    int width;              // expected frame size, checked against the JPEG header
+    int height;
+    int left;               // first ROI column, as coffee_frame_t
+    int right;              // one past the last ROI column
+    int terms;              // F(0,0)..F(0,terms-1) per block, 1 (DC only) to JPEG_DCT_MAX_TERMS
+} jpeg_dct_frame_t;
+
+// Luma block means, one byte per 8x8 block.
+#define JPEG_DCT_THUMB_WIDTH(width)   (((width) + 7) / 8)
+#define JPEG_DCT_THUMB_HEIGHT(height) (((height) + 7) / 8)
+
+// Fills row_avg (height entries, mean luma of the ROI columns, rounded out
+// to whole blocks) and thumb (JPEG_DCT_THUMB_WIDTH x JPEG_DCT_THUMB_HEIGHT,
+// may be NULL), and returns the strongest row-to-row change with the same
+// margin and tie rule as coffee_profile(). Returns false if the frame is
+// not a supported JPEG or is corrupt.
+bool jpeg_dct_profile(const jpeg_dct_frame_t *frame, int *row_avg, uint8_t *thumb, coffee_peak_t *peak);
+
+// Frame size from the SOF header, false if there is none.
+bool jpeg_dct_size(const uint8_t *data, size_t len, int *width, int *height);
+
+#endif
@@ -0,0 +1,38 @@
+// Record layout of the /record stream (see recorder.h), shared with
+// code that replays recordings off the device.
+#ifndef RECORD_FORMAT_H_
+#define RECORD_FORMAT_H_
+
+#include <stdint.h>
+
+#define RECORDER_MAGIC "CREC"
+#define RECORDER_VERSION 1
+
+// pixformat values, as pixformat_t in esp_camera.h.
+#define RECORDER_PIXFORMAT_YUV422    1
+#define RECORDER_PIXFORMAT_GRAYSCALE 2
+#define RECORDER_PIXFORMAT_JPEG      3
+
+// Little endian.
+typedef struct __attribute__((packed)) {
+    char magic[4];              // RECORDER_MAGIC
+    uint16_t header_len;        // sizeof(recorder_header_t), newer versions may append fields
+    uint16_t version;
+    uint32_t sequence;          // frames offered since the client attached, gaps are drops
+    int64_t timestamp;          // esp_timer_get_time() at capture, us
+    uint16_t width;
+    uint16_t height;
+    uint8_t pixformat;          // pixformat_t of the payload
+    uint8_t burst_index;        // position in the measurement burst
+    uint8_t quality;            // frame_quality_reason_t from the quality gate
+    uint8_t analyzed;           // 1 when level, line_y and exists are this frame's reading
+    float level;
+    int16_t line_y;             // in rows of the analysis buffer (analysis_scale applied)
+    int16_t analysis_height;
+    uint8_t exists;
+    uint8_t reserved[3];
+    uint32_t settings_len;
+    uint32_t payload_len;
+} recorder_header_t;
+
+#endif
@@ -0,0 +1,95 @@
+// Frame recorder for building replay corpora, see recorder.h.
+#include <string.h>
+#include "Arduino.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "recorder.h"
+#include "settings.h"
+
+static_assert(PIXFORMAT_JPEG == RECORDER_PIXFORMAT_JPEG &&
+    PIXFORMAT_GRAYSCALE == RECORDER_PIXFORMAT_GRAYSCALE &&
+    PIXFORMAT_YUV422 == RECORDER_PIXFORMAT_YUV422, "record_format.h pixformats out of sync with esp_camera.h");
+
+static QueueHandle_t recorder_q = NULL;
+static bool recorder_active = false;
+static uint32_t recorder_pending = 0;   // claimed and not yet sent or freed
+static uint32_t recorder_sequence = 0;
+
+recorder_header_t *recorder_claim(const camera_fb_t *fb, int64_t timestamp){
+    if(!__atomic_load_n(&recorder_active, __ATOMIC_ACQUIRE)){
+        return NULL;
+    }
+    uint32_t sequence = __atomic_fetch_add(&recorder_sequence, 1, __ATOMIC_RELAXED);
+    if(__atomic_add_fetch(&recorder_pending, 1, __ATOMIC_RELAXED) > RECORDER_DEPTH){
+        __atomic_sub_fetch(&recorder_pending, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    recorder_header_t *frame = (recorder_header_t *)malloc(sizeof(recorder_header_t) + SETTINGS_JSON_MAX + fb->len);
+    if(!frame){
+        __atomic_sub_fetch(&recorder_pending, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    memset(frame, 0, sizeof(*frame));
+    memcpy(frame->magic, RECORDER_MAGIC, sizeof(frame->magic));
+    frame->header_len = sizeof(recorder_header_t);
+    frame->version = RECORDER_VERSION;
+    frame->sequence = sequence;
+    frame->timestamp = timestamp;
+    frame->width = fb->width;
+    frame->height = fb->height;
+    frame->pixformat = fb->format;
+
+    char *settings = (char *)(frame + 1);
+    frame->settings_len = settings_status_json(esp_camera_sensor_get(), settings);
+    frame->payload_len = fb->len;
+    memcpy(settings + frame->settings_len, fb->buf, fb->len);
+    return frame;
+}
+
+void recorder_discard(recorder_header_t *frame){
+    free(frame);
+    __atomic_sub_fetch(&recorder_pending, 1, __ATOMIC_RELAXED);
+}
+
+void recorder_publish(recorder_header_t *frame){
+    if(!recorder_q || xQueueSend(recorder_q, &frame, 0) != pdTRUE){
+        recorder_discard(frame);
+    }
+}
+
+static void recorder_drain(){
+    recorder_header_t *frame;
+    while(xQueueReceive(recorder_q, &frame, 0) == pdTRUE){
+        recorder_discard(frame);
+    }
+}
+
+bool recorder_attach(){
+    if(!recorder_q){
+        recorder_q = xQueueCreate(RECORDER_DEPTH, sizeof(recorder_header_t *));
+        if(!recorder_q){
+            return false;
+        }
+    }
+    if(__atomic_exchange_n(&recorder_active, true, __ATOMIC_ACQ_REL)){
+        return false;
+    }
+
+    //a frame published after the last client left must not reach this one
+    recorder_drain();
+    __atomic_store_n(&recorder_sequence, 0, __ATOMIC_RELAXED);
+    Serial.println("Recording started");
+    return true;
+}
+
+recorder_header_t *recorder_next(){
+    recorder_header_t *frame;
+    return xQueueReceive(recorder_q, &frame, 0) == pdTRUE ? frame : NULL;
+}
+
+void recorder_detach(){
+    __atomic_store_n(&recorder_active, false, __ATOMIC_RELEASE);
+    recorder_drain();
+    Serial.println("Recording stopped");
+}
@@ -0,0 +1,53 @@
+// Frame recorder for building replay corpora.
+//
+// GET /record (stream_server.h, port 81) streams the sensor frames the measurement
+// burst analyzes, untouched: the JPEG as captured, or the raw GRAYSCALE /
+// YUV422 buffer. The recorder taps the burst instead of capturing on its
+// own, so the measurement cadence is unchanged and each frame comes with
+// the reading the device computed for it.
+//
+// The response is a sequence of records, each one:
+//
+//   recorder_header_t   (record_format.h, header_len bytes)
+//   settings            (settings_len bytes, the /status JSON at capture)
+//   payload             (payload_len bytes, the frame buffer)
+//
+// A slow client never stalls the measurement. When RECORDER_DEPTH frames are
+// already waiting the frame is left out of the recording, which shows up as
+// a gap in sequence.
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include "esp_camera.h"
+#include "record_format.h"
+
+// Frames copied but not yet sent.
+#define RECORDER_DEPTH 2
+
+// Copies fb and the current settings for an attached client. Returns NULL
+// when nobody is recording or the client is RECORDER_DEPTH frames behind.
+// The reading fields are filled by the caller before recorder_publish().
+recorder_header_t *recorder_claim(const camera_fb_t *fb, int64_t timestamp);
+
+// Hands a claimed frame to the client. Never blocks.
+void recorder_publish(recorder_header_t *frame);
+
+// Drops a claimed frame that will not be published.
+void recorder_discard(recorder_header_t *frame);
+
+// Starts a recording for a new client. Returns false when another client
+// is already recording.
+bool recorder_attach();
+
+// Next published frame, NULL if none is waiting. The client sends it as is
+// (recorder_frame_len() bytes) and then frees it with recorder_discard().
+recorder_header_t *recorder_next();
+
+static inline size_t recorder_frame_len(const recorder_header_t *frame){
+    return frame->header_len + frame->settings_len + frame->payload_len;
+}
+
+// Ends the recording and drops the frames still waiting.
+void recorder_detach();
+
+#endif
@@ -0,0 +1,179 @@
+// Settings registry runtime: storage access, perfect-hash lookup, bulk apply
+// and /status serialization. The table itself lives in settings.h.
+#include <string.h>
+#include <EEPROM.h>
+#include "settings.h"
+#include "camera_control.h"
+
+#define SETTINGS_NO_BUCKET 0xFF
+
+static_assert(SETTINGS_COUNT < SETTINGS_NO_BUCKET, "settings_table: too many settings for the bucket table");
+
+// Bucket -> table index, generated at compile time from the seed found in
+// settings.h.
+typedef struct {
+    uint8_t index[SETTINGS_HASH_BUCKETS];
+} settings_buckets_t;
+
+template<size_t... I> struct settings_seq {};
+template<size_t N, size_t... I> struct settings_make_seq : settings_make_seq<N - 1, N - 1, I...> {};
+template<size_t... I> struct settings_make_seq<0, I...> { typedef settings_seq<I...> type; };
+
+static constexpr uint8_t settings_bucket_owner(uint32_t bucket, size_t i){
+    return i >= SETTINGS_COUNT ? SETTINGS_NO_BUCKET :
+        (settings_hash(settings_table[i].name, SETTINGS_HASH_SEED) == bucket ? (uint8_t)i : settings_bucket_owner(bucket, i + 1));
+}
+
+template<size_t... B>
+static constexpr settings_buckets_t settings_build_buckets(settings_seq<B...>){
+    return {{ settings_bucket_owner(B, 0)... }};
+}
+
+static constexpr settings_buckets_t settings_buckets =
+    settings_build_buckets(typename settings_make_seq<SETTINGS_HASH_BUCKETS>::type());
+
+void settings_begin(){
+    EEPROM.begin(SETTINGS_STORAGE_SIZE);
+}
+
+void settings_commit(){
+    EEPROM.commit();
+}
+
+int settings_find(const char *name){
+    uint8_t i = settings_buckets.index[settings_hash(name, SETTINGS_HASH_SEED)];
+    if(i == SETTINGS_NO_BUCKET || strcmp(settings_table[i].name, name)){
+        return -1;
+    }
+    return i;
+}
+
+static bool settings_in_range(size_t id, int val){
+    return val >= settings_table[id].min && val <= settings_table[id].max;
+}
+
+int settings_read(size_t id){
+    const setting_t *e = &settings_table[id];
+    int val;
+    switch(e->type){
+        case SETTING_I8:
+            val = (int8_t)EEPROM.read(e->slot);
+            break;
+        case SETTING_U16:
+            val = EEPROM.read(e->slot) | (EEPROM.read(e->slot + 1) << 8);
+            break;
+        default:
+            val = EEPROM.read(e->slot);
+            break;
+    }
+    return settings_in_range(id, val) ? val : e->def;
+}
+
+void settings_write(size_t id, int val){
+    const setting_t *e = &settings_table[id];
+    EEPROM.write(e->slot, val & 0xFF);
+    if(e->type == SETTING_U16){
+        EEPROM.write(e->slot + 1, (val >> 8) & 0xFF);
+    }
+}
+
+void settings_apply(sensor_t *s){
+    for(size_t i = 0; i < SETTINGS_COUNT; i++){
+        if(settings_table[i].set){
+            settings_table[i].set(s, settings_read(i));
+        }
+    }
+}
+
+settings_set_result_t settings_set(sensor_t *s, const char *name, int val){
+    int id = settings_find(name);
+    if(id < 0){
+        return SETTINGS_SET_UNKNOWN;
+    }
+    if(!settings_in_range(id, val)){
+        return SETTINGS_SET_RANGE;
+    }
+    if(settings_table[id].set && settings_table[id].set(s, val)){
+        return SETTINGS_SET_FAILED;
+    }
+    settings_write(id, val);
+    return SETTINGS_SET_OK;
+}
+
+// Raw pixformats size their frame buffers at init, so a new frame size needs
+// a reinit there. The new value is stored first because the reinit reads it.
+int setting_set_framesize(sensor_t *s, int val){
+    if(s->pixformat == PIXFORMAT_JPEG){
+        return s->set_framesize(s, (framesize_t)val);
+    }
+    if(val == s->status.framesize){
+        return 0;
+    }
+    if(val > CAMERA_RAW_MAX_FRAMESIZE){
+        return -1;
+    }
+    int previous = s->status.framesize;
+    settings_write(SETTING_ID("framesize"), val);
+    if(camera_reconfigure() != ESP_OK){
+        settings_write(SETTING_ID("framesize"), previous);
+        camera_reconfigure();
+        return -1;
+    }
+    return 0;
+}
+
+int setting_get_framesize(const sensor_t *s){
+    return s->status.framesize;
+}
+
+int setting_set_pixformat(sensor_t *s, int val){
+    int previous = camera_format_index(s->pixformat);
+    if(val == previous){
+        return 0;
+    }
+    settings_write(SETTING_ID("pixformat"), val);
+    if(camera_reconfigure() != ESP_OK){
+        settings_write(SETTING_ID("pixformat"), previous);
+        camera_reconfigure();
+        return -1;
+    }
+    return 0;
+}
+
+int setting_get_pixformat(const sensor_t *s){
+    return camera_format_index(s->pixformat);
+}
+
+static char * settings_put_int(char *p, int val){
+    char tmp[10];
+    size_t n = 0;
+    unsigned int u = val < 0 ? -val : val;
+    if(val < 0){
+        *p++ = '-';
+    }
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while(u);
+    while(n){
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+size_t settings_status_json(const sensor_t *s, char *out){
+    char *p = out;
+    *p++ = '{';
+    for(size_t i = 0; i < SETTINGS_COUNT; i++){
+        const setting_t *e = &settings_table[i];
+        if(i){
+            *p++ = ',';
+        }
+        memcpy(p, e->json_key, e->json_key_len);
+        p += e->json_key_len;
+        p = settings_put_int(p, e->get ? e->get(s) : settings_read(i));
+    }
+    *p++ = '}';
+    *p = 0;
+    return p - out;
+}
@@ -0,0 +1,293 @@
+// Settings registry.
+//
+// Every user-tunable value (camera sensor registers and coffee-pot
+// calibration) is described once in settings_table below. /control parsing,
+// /status serialization, persistent storage and the boot-time apply are all
+// driven from this table, so adding a setting means adding one line here.
+//
+// Storage is the EEPROM emulation; each entry owns [slot, slot + width).
+// Slots must not overlap and the perfect hash used by settings_find() must
+// be collision free - both are checked at compile time below.
+#ifndef SETTINGS_H_
+#define SETTINGS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_camera.h"
+
+typedef enum {
+    SETTING_U8,
+    SETTING_I8,
+    SETTING_U16,
+} setting_type_t;
+
+typedef int (*setting_set_fn)(sensor_t *s, int val);
+typedef int (*setting_get_fn)(const sensor_t *s);
+
+typedef struct {
+    const char *name;
+    const char *json_key;       // "\"name\":" ready to be copied into /status
+    uint8_t json_key_len;
+    uint8_t slot;               // first storage byte
+    setting_type_t type;
+    int16_t min;
+    int16_t max;
+    int16_t def;                // used while the stored value is out of range (e.g. erased storage)
+    setting_set_fn set;         // pushes the value to the sensor, NULL for storage-only settings
+    setting_get_fn get;         // reads back the sensor status, NULL to report the stored value
+} setting_t;
+
+// Sensor accessors. Changing pixformat, or framesize in a raw pixformat,
+// reinitializes the camera (settings.cpp).
+int setting_set_framesize(sensor_t *s, int val);
+int setting_get_framesize(const sensor_t *s);
+int setting_set_pixformat(sensor_t *s, int val);
+int setting_get_pixformat(const sensor_t *s);
+
+#define SETTING_SENSOR_ACCESSORS(field, setter, cast) \
+    static inline int setting_set_##field(sensor_t *s, int val){ return s->setter(s, (cast)val); } \
+    static inline int setting_get_##field(const sensor_t *s){ return s->status.field; }
+
+SETTING_SENSOR_ACCESSORS(quality,        set_quality,        int)
+SETTING_SENSOR_ACCESSORS(brightness,     set_brightness,     int)
+SETTING_SENSOR_ACCESSORS(contrast,       set_contrast,       int)
+SETTING_SENSOR_ACCESSORS(saturation,     set_saturation,     int)
+SETTING_SENSOR_ACCESSORS(gainceiling,    set_gainceiling,    gainceiling_t)
+SETTING_SENSOR_ACCESSORS(colorbar,       set_colorbar,       int)
+SETTING_SENSOR_ACCESSORS(awb,            set_whitebal,       int)
+SETTING_SENSOR_ACCESSORS(agc,            set_gain_ctrl,      int)
+SETTING_SENSOR_ACCESSORS(aec,            set_exposure_ctrl,  int)
+SETTING_SENSOR_ACCESSORS(hmirror,        set_hmirror,        int)
+SETTING_SENSOR_ACCESSORS(vflip,          set_vflip,          int)
+SETTING_SENSOR_ACCESSORS(awb_gain,       set_awb_gain,       int)
+SETTING_SENSOR_ACCESSORS(agc_gain,       set_agc_gain,       int)
+SETTING_SENSOR_ACCESSORS(aec_value,      set_aec_value,      int)
+SETTING_SENSOR_ACCESSORS(aec2,           set_aec2,           int)
+SETTING_SENSOR_ACCESSORS(dcw,            set_dcw,            int)
+SETTING_SENSOR_ACCESSORS(bpc,            set_bpc,            int)
+SETTING_SENSOR_ACCESSORS(wpc,            set_wpc,            int)
+SETTING_SENSOR_ACCESSORS(raw_gma,        set_raw_gma,        int)
+SETTING_SENSOR_ACCESSORS(lenc,           set_lenc,           int)
+SETTING_SENSOR_ACCESSORS(special_effect, set_special_effect, int)
+SETTING_SENSOR_ACCESSORS(wb_mode,        set_wb_mode,        int)
+SETTING_SENSOR_ACCESSORS(ae_level,       set_ae_level,       int)
+
+#define SETTING_JSON_KEY(name) "\"" #name "\":"
+
+#define SETTING_SENSOR(name, slot, type, min, max, def) \
+    { #name, SETTING_JSON_KEY(name), sizeof(SETTING_JSON_KEY(name)) - 1, slot, type, min, max, def, \
+      setting_set_##name, setting_get_##name }
+
+#define SETTING_STORED(name, slot, type, min, max, def) \
+    { #name, SETTING_JSON_KEY(name), sizeof(SETTING_JSON_KEY(name)) - 1, slot, type, min, max, def, \
+      NULL, NULL }
+
+// Slots 0-27 keep the layout older firmware wrote, so calibrated devices
+// survive an update. Sensor values that used to share a slot with a coffee
+// setting have been moved past 27.
+static constexpr setting_t settings_table[] = {
+    SETTING_SENSOR(framesize,               0,  SETTING_U8,  0,  FRAMESIZE_UXGA, FRAMESIZE_QVGA),
+    SETTING_SENSOR(quality,                 1,  SETTING_U8,  0,  63,             10),
+    SETTING_SENSOR(contrast,                2,  SETTING_I8,  -2, 2,              0),
+    SETTING_SENSOR(brightness,              3,  SETTING_I8,  -2, 2,              0),
+    SETTING_SENSOR(saturation,              4,  SETTING_I8,  -2, 2,              0),
+    SETTING_SENSOR(gainceiling,             5,  SETTING_U8,  0,  6,              0),
+    SETTING_SENSOR(colorbar,                6,  SETTING_U8,  0,  1,              0),
+    SETTING_SENSOR(awb,                     7,  SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(aec,                     9,  SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(hmirror,                 10, SETTING_U8,  0,  1,              0),
+    SETTING_SENSOR(vflip,                   11, SETTING_U8,  0,  1,              0),
+    SETTING_SENSOR(awb_gain,                12, SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(agc_gain,                13, SETTING_U8,  0,  30,             0),
+    SETTING_SENSOR(aec2,                    15, SETTING_U8,  0,  1,              0),
+    SETTING_SENSOR(dcw,                     16, SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(ae_level,                23, SETTING_I8,  -2, 2,              0),
+    SETTING_SENSOR(agc,                     28, SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(aec_value,               29, SETTING_U16, 0,  1200,           300),
+    SETTING_SENSOR(bpc,                     31, SETTING_U8,  0,  1,              0),
+    SETTING_SENSOR(wpc,                     32, SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(raw_gma,                 33, SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(lenc,                    34, SETTING_U8,  0,  1,              1),
+    SETTING_SENSOR(special_effect,          35, SETTING_U8,  0,  6,              0),
+    SETTING_SENSOR(wb_mode,                 36, SETTING_U8,  0,  4,              0),
+    SETTING_SENSOR(pixformat,               40, SETTING_U8,  0,  2,              0),   // 0 JPEG, 1 GRAYSCALE, 2 YUV422
+
+    //Coffee Settings
+    SETTING_STORED(coffee_min,              24, SETTING_U8,  0,  100,            10),
+    SETTING_STORED(coffee_max,              25, SETTING_U8,  0,  100,            90),
+    SETTING_STORED(coffee_left,             26, SETTING_U8,  0,  100,            0),
+    SETTING_STORED(coffee_right,            27, SETTING_U8,  0,  100,            100),
+    SETTING_STORED(coffee_cups,             17, SETTING_U8,  0,  254,            12),  // 255 is erased storage
+    SETTING_STORED(coffee_text,             18, SETTING_U8,  0,  1,              1),
+    SETTING_STORED(coffee_obscure,          19, SETTING_U8,  0,  1,              0),
+    SETTING_STORED(coffee_potid,            20, SETTING_U8,  0,  254,            0),   // 255 is erased storage
+    SETTING_STORED(coffee_exists_x,         21, SETTING_U8,  0,  100,            50),
+    SETTING_STORED(coffee_exists_y,         22, SETTING_U8,  0,  100,            50),
+    SETTING_STORED(coffee_exists_threshold, 8,  SETTING_U8,  0,  255,            255),
+
+    //Measurement
+    SETTING_STORED(burst_frames,            37, SETTING_U8,  1,  9,              3),
+    SETTING_STORED(burst_fusion,            38, SETTING_U8,  0,  1,              0),   // 0 median, 1 trimmed mean
+    SETTING_STORED(analysis_workers,        39, SETTING_U8,  1,  2,              2),   // row profile tasks, one per core
+    SETTING_STORED(analysis_scale,          41, SETTING_U8,  0,  3,              0),   // analyze at 1/2^n of the frame size
+    SETTING_STORED(analysis_engine,         48, SETTING_U8,  0,  2,              0),   // 0 decode, 1 JPEG DCT profile, 2 both and compare
+    SETTING_STORED(dct_terms,               49, SETTING_U8,  1,  8,              4),   // vertical DCT terms per block, 1 DC only
+
+    //Preview
+    SETTING_STORED(preview_scale,           42, SETTING_U8,  0,  3,              0),   // /stream at 1/2^n of the frame size
+    SETTING_STORED(preview_source,          43, SETTING_U8,  0,  1,              0),   // 0 annotated, 1 sensor frame as is
+    SETTING_STORED(stream_clients,          50, SETTING_U8,  1,  8,              4),   // concurrent /stream viewers, capped by the lwIP sockets (4 on the device)
+
+    //Quality gate
+    SETTING_STORED(quality_dark,            44, SETTING_U8,  0,  100,            90),  // max % of ROI samples in the darkest bin
+    SETTING_STORED(quality_saturated,       45, SETTING_U8,  0,  100,            50),  // max % of ROI samples in the brightest bin
+    SETTING_STORED(quality_sharpness,       46, SETTING_U8,  0,  254,            0),   // min mean gradient, 0 off; 255 is erased storage
+    SETTING_STORED(quality_retries,         47, SETTING_U8,  0,  9,              2),   // extra frames captured per burst for rejects
+};
+
+#define SETTINGS_COUNT (sizeof(settings_table) / sizeof(settings_table[0]))
+
+// ---------------------------------------------------------------------------
+// Compile-time checks. Written as single-return recursion so they stay valid
+// C++11 constexpr.
+
+static constexpr size_t setting_width(setting_type_t type){
+    return type == SETTING_U16 ? 2 : 1;
+}
+
+static constexpr size_t setting_end(size_t i){
+    return settings_table[i].slot + setting_width(settings_table[i].type);
+}
+
+static constexpr size_t settings_max(size_t a, size_t b){
+    return a > b ? a : b;
+}
+
+static constexpr size_t settings_storage_size_from(size_t i){
+    return i >= SETTINGS_COUNT ? 0 : settings_max(setting_end(i), settings_storage_size_from(i + 1));
+}
+
+// Bytes of persistent storage the table needs.
+#define SETTINGS_STORAGE_SIZE (settings_storage_size_from(0))
+
+static constexpr bool settings_overlap(size_t i, size_t j){
+    return settings_table[i].slot < setting_end(j) && settings_table[j].slot < setting_end(i);
+}
+
+static constexpr bool settings_row_disjoint(size_t i, size_t j){
+    return j >= SETTINGS_COUNT || (!settings_overlap(i, j) && settings_row_disjoint(i, j + 1));
+}
+
+static constexpr bool settings_slots_disjoint(size_t i){
+    return i >= SETTINGS_COUNT || (settings_row_disjoint(i, i + 1) && settings_slots_disjoint(i + 1));
+}
+
+static_assert(settings_slots_disjoint(0), "settings_table: two settings share a storage slot");
+
+static constexpr bool setting_range_valid(size_t i){
+    return settings_table[i].min <= settings_table[i].def && settings_table[i].def <= settings_table[i].max &&
+        (settings_table[i].type == SETTING_U8  ? settings_table[i].min >= 0    && settings_table[i].max <= 255 :
+         settings_table[i].type == SETTING_I8  ? settings_table[i].min >= -128 && settings_table[i].max <= 127 :
+                                                 settings_table[i].min >= 0);
+}
+
+static constexpr bool settings_ranges_valid(size_t i){
+    return i >= SETTINGS_COUNT || (setting_range_valid(i) && settings_ranges_valid(i + 1));
+}
+
+static_assert(settings_ranges_valid(0), "settings_table: range does not fit the storage type");
+
+// Perfect hash: seeded FNV-1a folded to SETTINGS_HASH_BITS. The first seed
+// that gives every name its own bucket is searched at compile time, so
+// adding a setting never needs a hand-tuned constant.
+#define SETTINGS_HASH_BITS 9
+#define SETTINGS_HASH_BUCKETS (1u << SETTINGS_HASH_BITS)
+
+static constexpr uint32_t settings_fnv(const char *str, uint32_t h){
+    return *str ? settings_fnv(str + 1, (h ^ (uint8_t)*str) * 16777619u) : h;
+}
+
+static constexpr uint32_t settings_fold(uint32_t h){
+    return (h ^ (h >> 16)) & (SETTINGS_HASH_BUCKETS - 1);
+}
+
+static constexpr uint32_t settings_hash(const char *str, uint32_t seed){
+    return settings_fold(settings_fnv(str, 2166136261u ^ (seed * 0x9E3779B9u)));
+}
+
+static constexpr bool settings_hash_row_unique(uint32_t seed, size_t i, size_t j){
+    return j >= SETTINGS_COUNT ||
+        (settings_hash(settings_table[i].name, seed) != settings_hash(settings_table[j].name, seed) &&
+         settings_hash_row_unique(seed, i, j + 1));
+}
+
+static constexpr bool settings_hash_unique(uint32_t seed, size_t i){
+    return i >= SETTINGS_COUNT || (settings_hash_row_unique(seed, i, i + 1) && settings_hash_unique(seed, i + 1));
+}
+
+static constexpr uint32_t settings_find_seed(uint32_t seed, uint32_t tries){
+    return settings_hash_unique(seed, 0) ? seed : (tries ? settings_find_seed(seed + 1, tries - 1) : UINT32_MAX);
+}
+
+static constexpr uint32_t settings_hash_seed = settings_find_seed(0, 255);
+
+#define SETTINGS_HASH_SEED settings_hash_seed
+
+static_assert(SETTINGS_HASH_SEED != UINT32_MAX, "settings_table: no perfect hash seed, raise SETTINGS_HASH_BITS");
+
+// Compile-time index of a setting by name, for code that reads a setting
+// directly (e.g. coffee_level()). Unknown names fail to compile.
+static constexpr bool settings_streq(const char *a, const char *b){
+    return *a == *b && (!*a || settings_streq(a + 1, b + 1));
+}
+
+static constexpr int settings_index_from(const char *name, size_t i){
+    return i >= SETTINGS_COUNT ? -1 :
+        (settings_streq(settings_table[i].name, name) ? (int)i : settings_index_from(name, i + 1));
+}
+
+template<int I> struct setting_id {
+    static_assert(I >= 0, "unknown setting name");
+    static constexpr size_t value = I;
+};
+
+#define SETTING_ID(name) (setting_id<settings_index_from(name, 0)>::value)
+
+// ---------------------------------------------------------------------------
+// Runtime API (settings.cpp).
+
+void settings_begin();
+void settings_commit();
+
+// Index of the named setting, or -1.
+int settings_find(const char *name);
+
+// Stored value, or the default when the stored value is out of range.
+int settings_read(size_t id);
+void settings_write(size_t id, int val);
+
+// Pushes every stored sensor setting to the sensor.
+void settings_apply(sensor_t *s);
+
+typedef enum {
+    SETTINGS_SET_OK = 0,
+    SETTINGS_SET_UNKNOWN,       // no setting of that name
+    SETTINGS_SET_RANGE,         // value outside [min, max]
+    SETTINGS_SET_FAILED,        // the sensor setter or a reinit failed
+} settings_set_result_t;
+
+// Validates, applies and stores one value.
+settings_set_result_t settings_set(sensor_t *s, const char *name, int val);
+
+// Writes the /status JSON object into out and returns its length.
+// out must hold at least SETTINGS_JSON_MAX bytes.
+size_t settings_status_json(const sensor_t *s, char *out);
+
+static constexpr size_t settings_json_max_from(size_t i){
+    // key + "-32768" + ','
+    return i >= SETTINGS_COUNT ? 0 : settings_table[i].json_key_len + 7 + settings_json_max_from(i + 1);
+}
+
+#define SETTINGS_JSON_MAX (settings_json_max_from(0) + 3)
+
+#endif
@@ -0,0 +1,376 @@
+// Event-driven stream server, see stream_server.h.
+#include <errno.h>
+#include <string.h>
+#include "Arduino.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "recorder.h"
+#include "settings.h"
+#include "stream_server.h"
+#include "trace.h"
+
+static_assert(settings_table[SETTING_ID("stream_clients")].max <= STREAM_MAX_CLIENTS, "stream_clients exceeds STREAM_MAX_CLIENTS");
+
+// Viewers, a recording and one connection being turned away.
+#define STREAM_MAX_SOCKETS (STREAM_MAX_CLIENTS + 2)
+
+// Viewers the lwIP socket pool leaves room for. CONFIG_LWIP_MAX_SOCKETS
+// (10 in the Arduino core) is shared by the port 80 httpd (listen and
+// control sockets and a browser connection), the uplink HTTPClient and the
+// listen socket here; of the rest one stays free for /record or a 503.
+#ifdef CONFIG_LWIP_MAX_SOCKETS
+#define STREAM_SOCKET_VIEWERS (CONFIG_LWIP_MAX_SOCKETS - 3 - 1 - 1 - 1)
+#else
+#define STREAM_SOCKET_VIEWERS STREAM_MAX_CLIENTS
+#endif
+static_assert(STREAM_SOCKET_VIEWERS >= 1, "no lwIP socket left for a /stream viewer");
+
+#define PART_BOUNDARY "123456789000000000000987654321"
+static const char STREAM_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Type: multipart/x-mixed-replace;boundary=" PART_BOUNDARY "\r\nConnection: close\r\n\r\n";
+static const char STREAM_PART[] = "\r\n--" PART_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n";
+static const char RECORD_RESPONSE[] = "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Disposition: attachment; filename=record.bin\r\nConnection: close\r\n\r\n";
+static const char NOT_FOUND_RESPONSE[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char RECORDING_RESPONSE[] = "HTTP/1.1 409 Conflict\r\nContent-Length: 17\r\nConnection: close\r\n\r\nAlready recording";
+static const char BUSY_RESPONSE[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 10\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+// A rendered preview frame, shared by the viewers sending it.
+typedef struct {
+    int refs;
+    uint32_t sequence;              // from 1
+    uint8_t *jpg;
+    size_t len;
+    size_t part_len;
+    char part[sizeof(STREAM_PART) + 8];  // boundary and part header
+} stream_frame_t;
+
+typedef enum {
+    STREAM_CLIENT_FREE = 0,
+    STREAM_CLIENT_REQUEST,          // waiting for the request line
+    STREAM_CLIENT_VIEWER,           // GET /stream
+    STREAM_CLIENT_RECORD,           // GET /record
+    STREAM_CLIENT_REPLY,            // sending a status reply, closed once sent
+} stream_client_state_t;
+
+typedef struct {
+    int fd;
+    stream_client_state_t state;
+    int64_t since;                  // accept, or the last send progress while output is pending
+    const uint8_t *chunk[2];        // pending output, chunk[0] first
+    size_t chunk_len[2];
+    int chunks;
+    size_t offset;                  // bytes of chunk[0] already sent
+    stream_frame_t *frame;          // referenced while its chunks are pending
+    recorder_header_t *record;
+    uint32_t sequence;              // last frame queued
+    char request[64];
+    size_t request_len;
+} stream_client_t;
+
+static struct {
+    stream_render_fn render;
+    QueueHandle_t frame_q;          // render task -> sender task, depth 1
+    TaskHandle_t render_task;
+    int listen_fd;
+    int viewers;                    // also read by the render task
+    stream_frame_t *latest;
+    stream_client_t client[STREAM_MAX_SOCKETS];
+} stream;
+
+static void stream_frame_release(stream_frame_t *frame){
+    if(!--frame->refs){
+        free(frame->jpg);
+        free(frame);
+    }
+}
+
+static void stream_client_queue(stream_client_t *c, const void *data, size_t len, int64_t now){
+    if(!c->chunks){
+        c->since = now;
+        c->offset = 0;
+    }
+    c->chunk[c->chunks] = (const uint8_t *)data;
+    c->chunk_len[c->chunks] = len;
+    c->chunks++;
+}
+
+static void stream_client_reply(stream_client_t *c, const char *response, size_t len, int64_t now){
+    c->state = STREAM_CLIENT_REPLY;
+    stream_client_queue(c, response, len, now);
+}
+
+static void stream_client_close(stream_client_t *c, const char *reason){
+    if(c->frame){
+        stream_frame_release(c->frame);
+    }
+    if(c->record){
+        recorder_discard(c->record);
+    }
+    if(c->state == STREAM_CLIENT_VIEWER){
+        __atomic_store_n(&stream.viewers, stream.viewers - 1, __ATOMIC_RELEASE);
+        Serial.printf("Stream viewer left (%s), %d watching\n", reason, stream.viewers);
+    } else if(c->state == STREAM_CLIENT_RECORD){
+        recorder_detach();
+    }
+    close(c->fd);
+    memset(c, 0, sizeof(*c));
+}
+
+// Handles the request line once it is complete, or once the buffer is full
+// (the path is at its start either way). Further input is discarded.
+static void stream_client_request(stream_client_t *c, int64_t now){
+    const char *path = c->request + 4;
+    size_t path_len = strcspn(path, " ?\r\n");
+
+    if(strncmp(c->request, "GET ", 4)){
+        path_len = 0;
+    }
+    if(path_len == 7 && !strncmp(path, "/stream", 7)){
+        if(stream.viewers >= settings_read(SETTING_ID("stream_clients")) || stream.viewers >= STREAM_SOCKET_VIEWERS){
+            stream_client_reply(c, BUSY_RESPONSE, sizeof(BUSY_RESPONSE) - 1, now);
+            return;
+        }
+        c->state = STREAM_CLIENT_VIEWER;
+        __atomic_store_n(&stream.viewers, stream.viewers + 1, __ATOMIC_RELEASE);
+        if(stream.viewers == 1){
+            xTaskNotifyGive(stream.render_task);
+        }
+        Serial.printf("Stream viewer joined, %d watching\n", stream.viewers);
+        stream_client_queue(c, STREAM_RESPONSE, sizeof(STREAM_RESPONSE) - 1, now);
+    } else if(path_len == 7 && !strncmp(path, "/record", 7)){
+        if(!recorder_attach()){
+            stream_client_reply(c, RECORDING_RESPONSE, sizeof(RECORDING_RESPONSE) - 1, now);
+            return;
+        }
+        c->state = STREAM_CLIENT_RECORD;
+        stream_client_queue(c, RECORD_RESPONSE, sizeof(RECORD_RESPONSE) - 1, now);
+    } else {
+        stream_client_reply(c, NOT_FOUND_RESPONSE, sizeof(NOT_FOUND_RESPONSE) - 1, now);
+    }
+}
+
+// Returns false when the peer has closed the connection.
+static bool stream_client_read(stream_client_t *c, int64_t now){
+    char discard[64];
+    bool request = c->state == STREAM_CLIENT_REQUEST;
+    char *buf = request ? c->request + c->request_len : discard;
+    size_t len = request ? sizeof(c->request) - 1 - c->request_len : sizeof(discard);
+
+    int n = recv(c->fd, buf, len, 0);
+    if(n < 0){
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if(!n){
+        return false;
+    }
+    if(request){
+        c->request_len += n;
+        c->request[c->request_len] = 0;
+        if(strchr(c->request, '\n') || c->request_len == sizeof(c->request) - 1){
+            stream_client_request(c, now);
+        }
+    }
+    return true;
+}
+
+// Sends as much pending output as the socket takes. Returns false on a
+// socket error or when a reply is complete.
+static bool stream_client_write(stream_client_t *c, int64_t now){
+    while(c->chunks){
+        int n = send(c->fd, c->chunk[0] + c->offset, c->chunk_len[0] - c->offset, 0);
+        if(n < 0){
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        c->since = now;
+        c->offset += n;
+        if(c->offset < c->chunk_len[0]){
+            continue;
+        }
+        c->offset = 0;
+        c->chunk[0] = c->chunk[1];
+        c->chunk_len[0] = c->chunk_len[1];
+        c->chunks--;
+    }
+    if(c->frame){
+        stream_frame_release(c->frame);
+        c->frame = NULL;
+    }
+    if(c->record){
+        recorder_discard(c->record);
+        c->record = NULL;
+    }
+    return c->state != STREAM_CLIENT_REPLY;
+}
+
+// Queues the next frame for a client that has sent everything.
+static void stream_client_next(stream_client_t *c, int64_t now){
+    if(c->chunks){
+        return;
+    }
+    if(c->state == STREAM_CLIENT_VIEWER && stream.latest && stream.latest->sequence != c->sequence){
+        c->frame = stream.latest;
+        c->frame->refs++;
+        c->sequence = c->frame->sequence;
+        stream_client_queue(c, c->frame->part, c->frame->part_len, now);
+        stream_client_queue(c, c->frame->jpg, c->frame->len, now);
+    } else if(c->state == STREAM_CLIENT_RECORD && (c->record = recorder_next())){
+        stream_client_queue(c, c->record, recorder_frame_len(c->record), now);
+    }
+}
+
+// Serves one client after select(). Returns why it must be closed, or NULL.
+static const char *stream_client_poll(stream_client_t *c, bool readable, bool writable, int64_t now){
+    if(readable && !stream_client_read(c, now)){
+        return "closed";
+    }
+    if(writable){
+        TRACE_BEGIN("send");
+        bool sent = stream_client_write(c, now);
+        TRACE_END("send");
+        if(!sent){
+            return c->state == STREAM_CLIENT_REPLY ? "replied" : "send failed";
+        }
+    }
+    if(c->state == STREAM_CLIENT_REQUEST && now - c->since > STREAM_IDLE_TIMEOUT_MS * 1000LL){
+        return "idle";
+    }
+    if(c->chunks && now - c->since > STREAM_STALL_TIMEOUT_MS * 1000LL){
+        return "stalled";
+    }
+    return NULL;
+}
+
+static void stream_accept(int64_t now){
+    int fd = accept(stream.listen_fd, NULL, NULL);
+    if(fd < 0){
+        return;
+    }
+    for(int i = 0; i < STREAM_MAX_SOCKETS; i++){
+        stream_client_t *c = &stream.client[i];
+        if(c->state == STREAM_CLIENT_FREE){
+            int one = 1;
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            c->fd = fd;
+            c->state = STREAM_CLIENT_REQUEST;
+            c->since = now;
+            return;
+        }
+    }
+    close(fd);
+}
+
+static void stream_sender_task(void *arg){
+    while(true){
+        stream_frame_t *frame;
+        if(xQueueReceive(stream.frame_q, &frame, 0) == pdTRUE){
+            if(stream.latest){
+                stream_frame_release(stream.latest);
+            }
+            stream.latest = frame;
+        }
+
+        fd_set readable;
+        fd_set writable;
+        int max_fd = stream.listen_fd;
+        int64_t now = esp_timer_get_time();
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(stream.listen_fd, &readable);
+        for(int i = 0; i < STREAM_MAX_SOCKETS; i++){
+            stream_client_t *c = &stream.client[i];
+            if(c->state == STREAM_CLIENT_FREE){
+                continue;
+            }
+            stream_client_next(c, now);
+            FD_SET(c->fd, &readable);
+            if(c->chunks){
+                FD_SET(c->fd, &writable);
+            }
+            if(c->fd > max_fd){
+                max_fd = c->fd;
+            }
+        }
+
+        struct timeval timeout = { 0, STREAM_POLL_MS * 1000 };
+        if(select(max_fd + 1, &readable, &writable, NULL, &timeout) < 0){
+            vTaskDelay(STREAM_POLL_MS / portTICK_PERIOD_MS);
+            continue;
+        }
+
+        now = esp_timer_get_time();
+        for(int i = 0; i < STREAM_MAX_SOCKETS; i++){
+            stream_client_t *c = &stream.client[i];
+            if(c->state != STREAM_CLIENT_FREE){
+                const char *reason = stream_client_poll(c, FD_ISSET(c->fd, &readable), FD_ISSET(c->fd, &writable), now);
+                if(reason){
+                    stream_client_close(c, reason);
+                }
+            }
+        }
+        //after the clients, a new socket may reuse a number closed above
+        if(FD_ISSET(stream.listen_fd, &readable)){
+            stream_accept(now);
+        }
+
+        if(!stream.viewers && stream.latest){
+            stream_frame_release(stream.latest);
+            stream.latest = NULL;
+        }
+    }
+}
+
+static void stream_render_task(void *arg){
+    uint32_t sequence = 0;
+    while(true){
+        if(!__atomic_load_n(&stream.viewers, __ATOMIC_ACQUIRE)){
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        stream_frame_t *frame = (stream_frame_t *)malloc(sizeof(stream_frame_t));
+        if(frame){
+            frame->jpg = stream.render(&frame->len);
+        }
+        if(!frame || !frame->jpg){
+            free(frame);
+            vTaskDelay(100 / portTICK_PERIOD_MS);
+            continue;
+        }
+        frame->refs = 1;
+        frame->sequence = ++sequence;
+        frame->part_len = snprintf(frame->part, sizeof(frame->part), STREAM_PART, (unsigned)frame->len);
+        xQueueSend(stream.frame_q, &frame, portMAX_DELAY);
+    }
+}
+
+bool stream_server_start(uint16_t port, stream_render_fn render){
+    struct sockaddr_in addr;
+    int one = 1;
+
+    stream.render = render;
+    stream.frame_q = xQueueCreate(1, sizeof(stream_frame_t *));
+    if(!stream.frame_q){
+        return false;
+    }
+
+    stream.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(stream.listen_fd < 0){
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    setsockopt(stream.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(stream.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(stream.listen_fd, 4) < 0){
+        close(stream.listen_fd);
+        return false;
+    }
+    fcntl(stream.listen_fd, F_SETFL, O_NONBLOCK);
+
+    return xTaskCreatePinnedToCore(stream_render_task, "stream_render", 4096, NULL, 5, &stream.render_task, tskNO_AFFINITY) == pdPASS &&
+        xTaskCreatePinnedToCore(stream_sender_task, "stream_send", 4096, NULL, 5, NULL, tskNO_AFFINITY) == pdPASS;
+}
@@ -0,0 +1,38 @@
+// Stream server on port 81: GET /stream (MJPEG preview) and GET /record
+// (recorder.h).
+//
+// esp_http_server runs every handler on its one task, so a /stream client
+// kept the whole port 81 server inside its send loop: a second viewer or a
+// /record client waited until the first viewer left, and a half-open viewer
+// blocked every frame for the send timeout.
+//
+// Here one task owns the listening socket and all client sockets. Sockets
+// are non-blocking; the task select()s on them and writes each client's
+// boundary + part header and frame as far as its socket accepts. Preview
+// frames are rendered once by a second task and shared by every viewer. A
+// viewer that falls behind skips to the newest frame instead of queueing.
+#ifndef STREAM_SERVER_H_
+#define STREAM_SERVER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Upper bound of the stream_clients setting, sizes the client table.
+#define STREAM_MAX_CLIENTS 8
+
+// A connection that has not sent its request line by then is closed.
+#define STREAM_IDLE_TIMEOUT_MS 5000
+// A client whose socket takes no bytes for this long while data is pending
+// is closed: the peer is gone without a FIN (half-open) or has stopped reading.
+#define STREAM_STALL_TIMEOUT_MS 10000
+// select() timeout, also the longest a rendered frame waits for the sender.
+#define STREAM_POLL_MS 10
+
+// Renders one preview frame. Returns a malloc()ed JPEG that the server
+// frees, or NULL on failure.
+typedef uint8_t *(*stream_render_fn)(size_t *len);
+
+// Starts listening on port and the sender and render tasks.
+bool stream_server_start(uint16_t port, stream_render_fn render);
+
+#endif
@@ -0,0 +1,149 @@
+// Per-frame trace recorder, see trace.h.
+#include "trace.h"
+
+#if TRACE_ENABLED
+
+#include <stdarg.h>
+#include <string.h>
+#include <stdio.h>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+static_assert((TRACE_EVENTS & (TRACE_EVENTS - 1)) == 0, "TRACE_EVENTS must be a power of two");
+
+#define TRACE_TASK_NAME_LEN 8
+
+typedef struct {
+    int64_t ts;
+    const char *name;
+    uint32_t tid;
+    volatile uint32_t seq;          // index + 1 once the event is complete, 0 while being written
+    char task[TRACE_TASK_NAME_LEN];
+    uint8_t core;
+    char phase;
+} trace_event_t;
+
+static trace_event_t trace_ring[TRACE_EVENTS];
+static uint32_t trace_head = 0;
+
+// The calling task's id and name, looked up on its first event only, so
+// each event copies a fixed 8 bytes instead of fetching and strncpy'ing the
+// name. ESP-IDF gives every task its own copy of __thread variables.
+typedef struct {
+    uint32_t tid;
+    char task[TRACE_TASK_NAME_LEN];
+} trace_task_t;
+
+static __thread trace_task_t trace_self;
+
+// Writers claim a slot with one atomic add, so any task on either core can
+// record without a lock. A slot is only trusted by the reader when its seq
+// matches the index it expects, which drops events torn by a wrap-around.
+void trace_event(const char *name, char phase){
+    int64_t ts = esp_timer_get_time();
+    uint32_t idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_event_t *e = &trace_ring[idx & (TRACE_EVENTS - 1)];
+    trace_task_t *self = &trace_self;
+
+    if(!self->tid){
+        TaskHandle_t task = xTaskGetCurrentTaskHandle();
+        strncpy(self->task, pcTaskGetTaskName(task), TRACE_TASK_NAME_LEN);
+        self->tid = (uint32_t)(uintptr_t)task;
+    }
+
+    e->seq = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->ts = ts;
+    e->name = name;
+    e->tid = self->tid;
+    e->core = xPortGetCoreID();
+    e->phase = phase;
+    memcpy(e->task, self->task, TRACE_TASK_NAME_LEN);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->seq = idx + 1;
+}
+
+typedef struct {
+    httpd_req_t *req;
+    char buf[1024];
+    size_t len;
+    esp_err_t res;
+} trace_writer_t;
+
+static void trace_flush(trace_writer_t *w){
+    if(w->len && w->res == ESP_OK){
+        w->res = httpd_resp_send_chunk(w->req, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+static void trace_printf(trace_writer_t *w, const char *format, ...){
+    va_list arg;
+    if(sizeof(w->buf) - w->len < 160){
+        trace_flush(w);
+    }
+    va_start(arg, format);
+    int len = vsnprintf(w->buf + w->len, sizeof(w->buf) - w->len, format, arg);
+    va_end(arg);
+    if(len > 0 && (size_t)len < sizeof(w->buf) - w->len){
+        w->len += len;
+    }
+}
+
+esp_err_t trace_handler(httpd_req_t *req){
+    static trace_writer_t w;
+    uint32_t tids[8];
+    size_t tid_count = 0;
+    bool first = true;
+
+    uint32_t end = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+
+    w.req = req;
+    w.len = 0;
+    w.res = ESP_OK;
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+    trace_printf(&w, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    for(uint32_t i = start; i < end && w.res == ESP_OK; i++){
+        const trace_event_t *e = &trace_ring[i & (TRACE_EVENTS - 1)];
+        trace_event_t copy;
+
+        if(e->seq != i + 1){
+            continue;
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        memcpy(&copy, (const void *)e, sizeof(copy));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(e->seq != i + 1){
+            continue;
+        }
+
+        size_t t = 0;
+        while(t < tid_count && tids[t] != copy.tid){
+            t++;
+        }
+        if(t == tid_count && tid_count < sizeof(tids) / sizeof(tids[0])){
+            tids[tid_count++] = copy.tid;
+            trace_printf(&w, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%.*s\"}}",
+                first ? "" : ",", copy.tid, TRACE_TASK_NAME_LEN, copy.task);
+            first = false;
+        }
+
+        trace_printf(&w, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":0,\"tid\":%u,\"args\":{\"core\":%u}}",
+            first ? "" : ",", copy.name, copy.phase, copy.ts, copy.tid, copy.core);
+        first = false;
+    }
+
+    trace_printf(&w, "]}");
+    trace_flush(&w);
+    if(w.res != ESP_OK){
+        return w.res;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,52 @@
+// Per-frame trace recorder.
+//
+// TRACE_BEGIN/TRACE_END record timestamped events into a lock-free ring
+// buffer shared by both cores. GET /trace dumps the ring as Chrome trace
+// event JSON (load it in chrome://tracing or ui.perfetto.dev).
+//
+// Set TRACE_ENABLED to 0 to compile every trace point out.
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Ring size in events, must be a power of two.
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 512
+#endif
+
+#include "esp_http_server.h"
+
+#if TRACE_ENABLED
+
+// name must be a string literal (only the pointer is stored).
+void trace_event(const char *name, char phase);
+
+esp_err_t trace_handler(httpd_req_t *req);
+
+class trace_scope_t {
+public:
+    explicit trace_scope_t(const char *name) : _name(name) { trace_event(_name, 'B'); }
+    ~trace_scope_t() { trace_event(_name, 'E'); }
+private:
+    const char *_name;
+};
+
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name)   trace_event(name, 'E')
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+// Begin now, end when the enclosing scope exits (covers early returns).
+#define TRACE_SCOPE(name) trace_scope_t TRACE_CONCAT(_trace_scope_, __LINE__)(name)
+
+#else
+
+#define TRACE_BEGIN(name) do {} while(0)
+#define TRACE_END(name)   do {} while(0)
+#define TRACE_SCOPE(name) do {} while(0)
+
+#endif
+
+#endif
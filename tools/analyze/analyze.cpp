@@ -0,0 +1,140 @@
+// Host build of the /analyze endpoint: measures JPEG files or /record
+// streams with the device's own analysis code.
+//
+//   cd tools/analyze
+//   g++ -O2 -I../../CameraWebServer -o analyze analyze.cpp
+//       ../../CameraWebServer/{coffee_analyze,jpeg_dct,coffee_profile,frame_quality,frame_scale}.cpp
+//       -lpthread
+//
+// (one command line). Add -DANALYZE_LIBJPEG and -ljpeg to also measure
+// JPEGs with the decode engine, the device's default analysis_engine; each
+// line then carries both readings and their timings (coffee_analyze.h).
+//
+//   ./analyze [name=value ...] [file ...]
+//
+// Reads stdin without files, e.g. curl -s http://camera:81/record | ./analyze.
+// name=value overrides a parameter (see coffee_param_names), also for
+// recordings, which otherwise use the settings they were captured with.
+// Writes one JSON line per frame and a summary to stderr.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include "coffee_analyze.h"
+
+#ifdef ANALYZE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf fail;
+} jpeg_error_t;
+
+static void jpeg_fail(j_common_ptr cinfo){
+    longjmp(((jpeg_error_t *)cinfo->err)->fail, 1);
+}
+
+// Decodes to BGR888 like fmt2rgb888(). The two decoders round the IDCT
+// differently, so levels may differ from the device's by a row.
+static bool jpeg_decode(void *, const uint8_t *jpeg, size_t len, int width, int height, uint8_t *bgr){
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_t error;
+    cinfo.err = jpeg_std_error(&error.mgr);
+    error.mgr.error_exit = jpeg_fail;
+    if(setjmp(error.fail)){
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char *)jpeg, len);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_EXT_BGR;
+    jpeg_start_decompress(&cinfo);
+    if((int)cinfo.output_width != width || (int)cinfo.output_height != height){
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    while(cinfo.output_scanline < cinfo.output_height){
+        JSAMPROW row = bgr + (size_t)cinfo.output_scanline * cinfo.output_width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+#else
+#define jpeg_decode NULL
+#endif
+
+static int file_read(void *ctx, uint8_t *buf, size_t len){
+    FILE *f = (FILE *)ctx;
+    size_t n = fread(buf, 1, len, f);
+    return n ? (int)n : (ferror(f) ? -1 : 0);
+}
+
+static bool file_write(void *, const char *text, size_t len){
+    return fwrite(text, 1, len, stdout) == len;
+}
+
+int main(int argc, char **argv){
+    coffee_params_t params = { COFFEE_PARAM_DEFAULTS };
+    coffee_analyze_buffers_t buffers;
+    uint32_t fixed = 0;
+    int files = 0;
+    int frames = 0;
+    int status = 0;
+
+    memset(&buffers, 0, sizeof(buffers));
+    for(int i = 1; i < argc; i++){
+        const char *eq = strchr(argv[i], '=');
+        if(!eq){
+            continue;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%.*s", (int)(eq - argv[i]), argv[i]);
+        int param = coffee_param_find(name);
+        if(param < 0){
+            fprintf(stderr, "unknown parameter %s\n", name);
+            return 2;
+        }
+        params.value[param] = atoi(eq + 1);
+        fixed |= 1u << param;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 1; i <= argc; i++){
+        FILE *f;
+        if(i < argc){
+            if(strchr(argv[i], '=')){
+                continue;
+            }
+            f = fopen(argv[i], "rb");
+            if(!f){
+                perror(argv[i]);
+                status = 1;
+                continue;
+            }
+        } else if(!files){
+            f = stdin;
+        } else {
+            break;
+        }
+        files++;
+        coffee_analyze_io_t io = { file_read, file_write, f, jpeg_decode };
+        int n = coffee_analyze_stream(&io, &params, fixed, &buffers);
+        if(n < 0){
+            fprintf(stderr, "%s: unreadable input\n", i < argc ? argv[i] : "stdin");
+            status = 1;
+        } else {
+            frames += n;
+        }
+        if(f != stdin){
+            fclose(f);
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "%d frames in %.3f s, %.0f fps\n", frames, seconds, seconds > 0 ? frames / seconds : 0);
+    coffee_analyze_free(&buffers);
+    return status;
+}
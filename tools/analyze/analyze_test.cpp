@@ -0,0 +1,107 @@
+// Checks of coffee_analyze_stream() on hand-built records that /analyze
+// must survive: frames too small to profile and readings that are not
+// finite, which JSON cannot hold.
+//
+//   cd tools/analyze
+//   g++ -O1 -g -fsanitize=address,undefined -I../../CameraWebServer -o analyze_test analyze_test.cpp
+//       ../../CameraWebServer/{coffee_analyze,jpeg_dct,coffee_profile,frame_quality,frame_scale}.cpp
+//       -lpthread
+//
+// (one command line)
+//
+//   ./analyze_test
+//
+// Prints each check and exits 1 if one fails.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include "coffee_analyze.h"
+#include "record_format.h"
+
+typedef struct {
+    std::string input;
+    size_t offset;
+    std::string output;
+} test_io_t;
+
+static int test_read(void *ctx, uint8_t *buf, size_t len){
+    test_io_t *t = (test_io_t *)ctx;
+    size_t n = t->input.size() - t->offset;
+    if(n > len){
+        n = len;
+    }
+    memcpy(buf, t->input.data() + t->offset, n);
+    t->offset += n;
+    return n;
+}
+
+static bool test_write(void *ctx, const char *text, size_t len){
+    ((test_io_t *)ctx)->output.append(text, len);
+    return true;
+}
+
+// A GRAYSCALE record of a width x height frame, light above dark below,
+// captured with settings, and the device's reading if recorded_level is set.
+static std::string test_record(int width, int height, const char *settings, const float *recorded_level = NULL){
+    recorder_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORDER_MAGIC, 4);
+    header.header_len = sizeof(header);
+    header.version = RECORDER_VERSION;
+    header.width = width;
+    header.height = height;
+    header.pixformat = RECORDER_PIXFORMAT_GRAYSCALE;
+    header.settings_len = strlen(settings);
+    header.payload_len = width * height;
+    if(recorded_level){
+        header.analyzed = 1;
+        header.level = *recorded_level;
+    }
+
+    std::string record((const char *)&header, sizeof(header));
+    record += settings;
+    for(int y = 0; y < height; y++){
+        record.append(width, y < height / 2 ? (char)200 : (char)40);
+    }
+    return record;
+}
+
+static std::string test_analyze(const std::string &input, const coffee_params_t *params){
+    coffee_analyze_buffers_t buffers;
+    test_io_t t = { input, 0, "" };
+    coffee_analyze_io_t io = { test_read, test_write, &t, NULL };
+    memset(&buffers, 0, sizeof(buffers));
+    coffee_analyze_stream(&io, params, 0, &buffers);
+    coffee_analyze_free(&buffers);
+    return t.output;
+}
+
+static int failures = 0;
+
+static void test_expect(const char *what, const std::string &output, const char *expected){
+    bool ok = output.find(expected) != std::string::npos;
+    printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+    if(!ok){
+        printf("      expected %s in %s", expected, output.c_str());
+        failures++;
+    }
+}
+
+int main(){
+    coffee_params_t params = { COFFEE_PARAM_DEFAULTS };
+    const char *scaled = "{\"analysis_scale\":3}";
+
+    test_expect("4x64 frame at 1/8 scale", test_analyze(test_record(4, 64, scaled), &params), "\"error\":\"bad size\"");
+    test_expect("64x4 frame at 1/8 scale", test_analyze(test_record(64, 4, scaled), &params), "\"error\":\"bad size\"");
+    test_expect("64x10 frame", test_analyze(test_record(64, 10, "{}"), &params), "\"error\":\"bad size\"");
+    test_expect("64x96 frame at 1/8 scale", test_analyze(test_record(64, 96, scaled), &params), "\"line_y\":6,");
+    test_expect("frames after a bad one", test_analyze(test_record(4, 64, scaled) + test_record(64, 64, "{}"), &params),
+        "{\"frame\":1,\"sequence\":0,\"width\":64,\"height\":64,");
+    float infinite = INFINITY;
+    test_expect("coffee_min equal to coffee_max",
+        test_analyze(test_record(64, 64, "{\"coffee_min\":50,\"coffee_max\":50}"), &params), "\"level\":null,");
+    test_expect("infinite recorded_level", test_analyze(test_record(64, 64, "{}", &infinite), &params), "\"recorded_level\":null,");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+// Host benchmark of coffee_profile() with 1..N workers: time per frame,
+// speedup over one worker, and a check that every worker count finds the
+// same coffee line as the serial pass.
+//
+//   cd tools/profile_bench
+//   g++ -O2 -I../../CameraWebServer -o profile_bench profile_bench.cpp
+//       ../../CameraWebServer/coffee_profile.cpp -lpthread
+//
+// (one command line)
+//
+//   ./profile_bench [workers [width height [bytes_per_pixel [frames]]]]
+//
+// Defaults to every hardware thread (at most COFFEE_PROFILE_MAX_WORKERS) on
+// a 1600x1200 BGR888 frame, the largest the device decodes. The device has
+// COFFEE_PROFILE_MAX_WORKERS 2, one per core; counts above that only show
+// how the split scales.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "coffee_profile.h"
+
+// A pot: dark coffee below line_y, light glass above, with some texture so
+// rows are not uniform.
+static void frame_fill(std::vector<uint8_t> &data, int width, int height, int bytes_per_pixel, int line_y){
+    unsigned seed = 1;
+    for(int y = 0; y < height; y++){
+        for(int x = 0; x < width * bytes_per_pixel; x++){
+            seed = seed * 1103515245 + 12345;
+            data[(size_t)y * width * bytes_per_pixel + x] = (y < line_y ? 180 : 60) + (seed >> 16) % 16;
+        }
+    }
+}
+
+int main(int argc, char **argv){
+    int max_workers = std::thread::hardware_concurrency();
+    int width = 1600;
+    int height = 1200;
+    int bytes_per_pixel = 3;
+    int frames = 50;
+
+    if(argc > 1){
+        max_workers = atoi(argv[1]);
+    }
+    if(argc > 3){
+        width = atoi(argv[2]);
+        height = atoi(argv[3]);
+    }
+    if(argc > 4){
+        bytes_per_pixel = atoi(argv[4]);
+    }
+    if(argc > 5){
+        frames = atoi(argv[5]);
+    }
+    if(max_workers < 1 || max_workers > COFFEE_PROFILE_MAX_WORKERS){
+        max_workers = COFFEE_PROFILE_MAX_WORKERS;
+    }
+    if(width <= 0 || height <= 2 * COFFEE_PROFILE_MARGIN || bytes_per_pixel <= 0 || frames <= 0){
+        fprintf(stderr, "usage: %s [workers [width height [bytes_per_pixel [frames]]]]\n", argv[0]);
+        return 2;
+    }
+    if(!coffee_profile_start()){
+        fprintf(stderr, "worker start failed\n");
+        return 1;
+    }
+
+    std::vector<uint8_t> data((size_t)width * height * bytes_per_pixel);
+    std::vector<int> rows(height);
+    frame_fill(data, width, height, bytes_per_pixel, height * 2 / 3);
+    coffee_frame_t frame = { data.data(), width, height, bytes_per_pixel, 0, width };
+    coffee_peak_t serial = coffee_profile(&frame, rows.data(), 1);
+
+    printf("%dx%d x%d, %d frames, line %d\n", width, height, bytes_per_pixel, frames, serial.line_y);
+    printf("workers   us/frame  speedup\n");
+    double base = 0;
+    int status = 0;
+    for(int workers = 1; workers <= max_workers; workers++){
+        coffee_peak_t peak = coffee_profile(&frame, rows.data(), workers); //warm up
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < frames; i++){
+            peak = coffee_profile(&frame, rows.data(), workers);
+        }
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / frames;
+        if(workers == 1){
+            base = us;
+        }
+        bool same = peak.line_y == serial.line_y && peak.strength == serial.strength;
+        printf("%7d %10.0f %8.2f%s\n", workers, us, base / us, same ? "" : "  MISMATCH");
+        if(!same){
+            status = 1;
+        }
+    }
+    return status;
+}
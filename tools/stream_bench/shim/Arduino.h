@@ -0,0 +1,23 @@
+// Host stand-ins for what stream_server.cpp uses from the ESP32 Arduino
+// core, ESP-IDF and FreeRTOS. Implemented in stream_bench.cpp.
+#ifndef SHIM_ARDUINO_H_
+#define SHIM_ARDUINO_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct SerialShim {
+    void printf(const char *format, ...){
+        va_list args;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+    }
+};
+
+extern SerialShim Serial;
+
+#endif
@@ -0,0 +1,8 @@
+// Only the types trace.h declares trace_handler() with.
+#ifndef SHIM_ESP_HTTP_SERVER_H_
+#define SHIM_ESP_HTTP_SERVER_H_
+
+typedef int esp_err_t;
+typedef struct httpd_req httpd_req_t;
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef SHIM_ESP_TIMER_H_
+#define SHIM_ESP_TIMER_H_
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time();
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef SHIM_FREERTOS_H_
+#define SHIM_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS 1
+
+#endif
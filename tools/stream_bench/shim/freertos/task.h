@@ -0,0 +1,17 @@
+#ifndef SHIM_FREERTOS_TASK_H_
+#define SHIM_FREERTOS_TASK_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct shim_task *TaskHandle_t;
+
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+// Tasks are std::threads; priority and core are ignored.
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void *), const char *name, uint32_t stack, void *arg,
+        int priority, TaskHandle_t *handle, int core);
+void vTaskDelay(TickType_t ticks);
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait);
+void xTaskNotifyGive(TaskHandle_t task);
+
+#endif
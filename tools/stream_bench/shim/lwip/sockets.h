@@ -0,0 +1,13 @@
+// lwIP's BSD socket API is the POSIX one.
+#ifndef SHIM_LWIP_SOCKETS_H_
+#define SHIM_LWIP_SOCKETS_H_
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#endif
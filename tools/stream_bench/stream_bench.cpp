@@ -0,0 +1,395 @@
+// Host run of the port 81 stream server (stream_server.cpp) over loopback:
+// FreeRTOS tasks and queues become std::threads and condition variables
+// (shim/), the preview render is a sleep, the recorder a canned frame.
+//
+//   cd tools/stream_bench
+//   g++ -O2 -Ishim -I../../CameraWebServer -o stream_bench stream_bench.cpp
+//       ../../CameraWebServer/stream_server.cpp -lpthread
+//
+// (one command line)
+//
+//   ./stream_bench [viewers [render_ms [frame_bytes]]]
+//
+// Defaults: 8 viewers (stream_clients at its maximum), a 50 ms render
+// (20 fps) and 30000 byte frames. Checks that
+//
+//   - one viewer over stream_clients gets 503
+//   - every viewer gets (nearly) every rendered frame, one render each
+//   - an idle connection is closed after STREAM_IDLE_TIMEOUT_MS
+//   - a viewer that stops reading does not slow the others, and its slot
+//     is reused once STREAM_STALL_TIMEOUT_MS drops it
+//   - a second /record gets 409, an unknown path 404
+//   - nothing is rendered once every viewer has left
+//   - the sender records "send" trace spans
+//
+// and exits 1 if one fails. Takes about 40 s, most of it waiting for the
+// stalled viewer: loopback buffers take several MB before its socket is
+// full and the stall timer starts.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Arduino.h"
+#include "esp_timer.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "recorder.h"
+#include "settings.h"
+#include "stream_server.h"
+#include "trace.h"
+
+#define BENCH_PORT 18081
+
+// --- shims -----------------------------------------------------------------
+
+SerialShim Serial;
+
+static const std::chrono::steady_clock::time_point bench_start = std::chrono::steady_clock::now();
+
+int64_t esp_timer_get_time(){
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bench_start).count();
+}
+
+static std::chrono::milliseconds shim_ticks(TickType_t ticks){
+    return std::chrono::milliseconds(ticks == portMAX_DELAY ? 24 * 3600 * 1000 : ticks);
+}
+
+struct shim_queue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t item_size;
+};
+
+QueueHandle_t xQueueCreate(int length, int item_size){
+    QueueHandle_t q = new shim_queue;
+    q->length = length;
+    q->item_size = item_size;
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t wait){
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if(!q->changed.wait_for(lock, shim_ticks(wait), [&]{ return q->items.size() < q->length; })){
+        return pdFALSE;
+    }
+    q->items.emplace_back((const uint8_t *)item, (const uint8_t *)item + q->item_size);
+    q->changed.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t wait){
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if(!q->changed.wait_for(lock, shim_ticks(wait), [&]{ return !q->items.empty(); })){
+        return pdFALSE;
+    }
+    memcpy(item, q->items.front().data(), q->item_size);
+    q->items.pop_front();
+    q->changed.notify_all();
+    return pdTRUE;
+}
+
+struct shim_task {
+    std::mutex mutex;
+    std::condition_variable notified;
+    uint32_t count;
+};
+
+static thread_local shim_task *shim_self;
+
+BaseType_t xTaskCreatePinnedToCore(void (*fn)(void *), const char *, uint32_t, void *arg, int, TaskHandle_t *handle, int){
+    shim_task *task = new shim_task();
+    if(handle){
+        *handle = task;
+    }
+    std::thread([=]{
+        shim_self = task;
+        fn(arg);
+    }).detach();
+    return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks){
+    std::this_thread::sleep_for(shim_ticks(ticks));
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t wait){
+    std::unique_lock<std::mutex> lock(shim_self->mutex);
+    if(!shim_self->notified.wait_for(lock, shim_ticks(wait), [&]{ return shim_self->count > 0; })){
+        return 0;
+    }
+    uint32_t count = shim_self->count;
+    shim_self->count = clear ? 0 : count - 1;
+    return count;
+}
+
+void xTaskNotifyGive(TaskHandle_t task){
+    std::lock_guard<std::mutex> lock(task->mutex);
+    task->count++;
+    task->notified.notify_all();
+}
+
+static std::atomic<int> send_spans(0);
+
+void trace_event(const char *name, char phase){
+    if(phase == 'B' && !strcmp(name, "send")){
+        send_spans++;
+    }
+}
+
+static int stream_clients = STREAM_MAX_CLIENTS;
+
+int settings_read(size_t id){
+    return id == SETTING_ID("stream_clients") ? stream_clients : 0;
+}
+
+// A recording of three frames with 100000 byte payloads.
+#define BENCH_RECORD_FRAMES 3
+#define BENCH_RECORD_PAYLOAD 100000
+
+static std::atomic<bool> record_attached(false);
+static std::atomic<int> record_left(0);
+
+bool recorder_attach(){
+    bool expected = false;
+    if(!record_attached.compare_exchange_strong(expected, true)){
+        return false;
+    }
+    record_left = BENCH_RECORD_FRAMES;
+    return true;
+}
+
+recorder_header_t *recorder_next(){
+    if(record_left <= 0){
+        return NULL;
+    }
+    record_left--;
+    recorder_header_t *frame = (recorder_header_t *)calloc(1, sizeof(recorder_header_t) + BENCH_RECORD_PAYLOAD);
+    memcpy(frame->magic, RECORDER_MAGIC, 4);
+    frame->header_len = sizeof(recorder_header_t);
+    frame->payload_len = BENCH_RECORD_PAYLOAD;
+    return frame;
+}
+
+void recorder_discard(recorder_header_t *frame){
+    free(frame);
+}
+
+void recorder_detach(){
+    record_attached = false;
+}
+
+static int render_ms = 50;
+static size_t frame_bytes = 30000;
+static std::atomic<int> renders(0);
+
+static uint8_t *bench_render(size_t *len){
+    std::this_thread::sleep_for(std::chrono::milliseconds(render_ms));
+    uint8_t *jpg = (uint8_t *)malloc(frame_bytes);
+    memset(jpg, 0x55, frame_bytes);
+    *len = frame_bytes;
+    renders++;
+    return jpg;
+}
+
+// --- clients ---------------------------------------------------------------
+
+static const char *const stream_request = "GET /stream HTTP/1.1\r\nHost: camera\r\n\r\n";
+
+// Connects and sends request unless NULL. rcvbuf > 0 shrinks the receive
+// buffer, for a viewer that fills up quickly.
+static int bench_connect(const char *request, int rcvbuf = 0){
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(rcvbuf > 0){
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BENCH_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr *)&addr, sizeof(addr))){
+        perror("connect");
+        exit(1);
+    }
+    if(request){
+        send(fd, request, strlen(request), 0);
+    }
+    return fd;
+}
+
+// First line of the response, "<closed>" or "<timeout>".
+static std::string bench_status_line(int fd){
+    char buf[256];
+    timeval tv = { 3, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int n = recv(fd, buf, sizeof(buf) - 1, 0);
+    if(n <= 0){
+        return n ? "<timeout>" : "<closed>";
+    }
+    buf[n] = 0;
+    return std::string(buf, strcspn(buf, "\r\n"));
+}
+
+// Bytes read within ms, -1 if the server closed the connection.
+static long bench_drain(int fd, int ms){
+    static thread_local char buf[65536];
+    timeval tv = { 0, 100000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    long total = 0;
+    while(std::chrono::steady_clock::now() < end){
+        int n = recv(fd, buf, sizeof(buf), 0);
+        if(!n){
+            return -1;
+        }
+        if(n > 0){
+            total += n;
+        }
+    }
+    return total;
+}
+
+// Drains every viewer for ms in parallel, returns frames received by each.
+static std::vector<double> bench_watch(const std::vector<int> &viewers, int ms){
+    std::vector<long> bytes(viewers.size());
+    std::vector<std::thread> threads;
+    for(size_t i = 0; i < viewers.size(); i++){
+        threads.emplace_back([&, i]{ bytes[i] = bench_drain(viewers[i], ms); });
+    }
+    for(auto &t : threads){
+        t.join();
+    }
+    std::vector<double> frames;
+    for(long b : bytes){
+        frames.push_back(b < 0 ? -1 : (double)b / frame_bytes);
+    }
+    return frames;
+}
+
+static int failures = 0;
+
+static void bench_check(bool ok, const char *what){
+    printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+    if(!ok){
+        failures++;
+    }
+}
+
+// Prints the rate of each viewer; true if all got at least 80% of the
+// rendered frames.
+static bool bench_report(const char *label, const std::vector<double> &frames, int rendered, int ms){
+    bool all = true;
+    printf("%s: %d renders, %.1f fps; per viewer fps", label, rendered, rendered * 1000.0 / ms);
+    for(double f : frames){
+        printf(" %.1f", f * 1000 / ms);
+        all = all && f >= rendered * 0.8;
+    }
+    printf("\n");
+    return all;
+}
+
+int main(int argc, char **argv){
+    int viewers_wanted = STREAM_MAX_CLIENTS;
+    if(argc > 1){
+        viewers_wanted = atoi(argv[1]);
+    }
+    if(argc > 2){
+        render_ms = atoi(argv[2]);
+    }
+    if(argc > 3){
+        frame_bytes = atol(argv[3]);
+    }
+    if(viewers_wanted < 2 || viewers_wanted > STREAM_MAX_CLIENTS || render_ms <= 0 || !frame_bytes){
+        fprintf(stderr, "usage: %s [viewers (2-%d) [render_ms [frame_bytes]]]\n", argv[0], STREAM_MAX_CLIENTS);
+        return 2;
+    }
+    stream_clients = viewers_wanted;
+    signal(SIGPIPE, SIG_IGN);
+    if(!stream_server_start(BENCH_PORT, bench_render)){
+        fprintf(stderr, "stream server failed to start\n");
+        return 1;
+    }
+
+    std::vector<int> viewers;
+    for(int i = 0; i < viewers_wanted; i++){
+        viewers.push_back(bench_connect(stream_request));
+    }
+    int extra = bench_connect(stream_request);
+    bench_check(bench_status_line(extra).find(" 503 ") != std::string::npos, "viewer over stream_clients gets 503");
+    close(extra);
+
+    bench_watch(viewers, 1000); //frames queued in the sockets while connecting
+    int rendered = renders;
+    std::vector<double> frames = bench_watch(viewers, 2000);
+    rendered = renders - rendered;
+    bench_check(bench_report("fan-out", frames, rendered, 2000), "every viewer gets the rendered frames");
+
+    //one viewer stops reading, another connection never sends a request
+    close(viewers.back());
+    viewers.pop_back();
+    int stalled = bench_connect(stream_request, 4096);
+    int idle = bench_connect(NULL);
+    double idle_closed = 0;
+    std::thread idle_watch([&]{
+        char c;
+        auto start = std::chrono::steady_clock::now();
+        timeval tv = { 30, 0 };
+        setsockopt(idle, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if(!recv(idle, &c, 1, 0)){
+            idle_closed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    });
+    rendered = renders;
+    frames = bench_watch(viewers, 12000);
+    rendered = renders - rendered;
+    idle_watch.join();
+    bench_check(bench_report("with a stalled viewer", frames, rendered, 12000), "a stalled viewer does not slow the others");
+    printf("idle connection closed after %.1f s\n", idle_closed);
+    bench_check(idle_closed >= STREAM_IDLE_TIMEOUT_MS / 1000.0 - 0.5 && idle_closed < STREAM_IDLE_TIMEOUT_MS / 1000.0 + 1,
+        "idle connection closed after STREAM_IDLE_TIMEOUT_MS");
+    close(idle);
+
+    //keep the others reading until the stalled viewer is dropped
+    bench_watch(viewers, STREAM_STALL_TIMEOUT_MS + 10000);
+    int again = bench_connect(stream_request);
+    bench_check(bench_status_line(again).find(" 200 ") != std::string::npos, "stalled viewer's slot is reused");
+
+    int record = bench_connect("GET /record HTTP/1.1\r\n\r\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    int record2 = bench_connect("GET /record HTTP/1.1\r\n\r\n");
+    bench_check(bench_status_line(record2).find(" 409 ") != std::string::npos, "second /record gets 409");
+    long record_bytes = bench_drain(record, 1000);
+    bench_check(record_bytes > (long)(BENCH_RECORD_FRAMES * (sizeof(recorder_header_t) + BENCH_RECORD_PAYLOAD)), "/record streams every frame");
+    int unknown = bench_connect("GET /nope HTTP/1.1\r\n\r\n");
+    bench_check(bench_status_line(unknown).find(" 404 ") != std::string::npos, "unknown path gets 404");
+
+    for(int fd : viewers){
+        close(fd);
+    }
+    close(again);
+    close(record);
+    close(record2);
+    close(unknown);
+    close(stalled);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    rendered = renders;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    bench_check(renders == rendered, "nothing rendered without viewers");
+    printf("%d send spans traced\n", (int)send_spans);
+    bench_check(send_spans > 0, "sends are traced");
+    return failures ? 1 : 0;
+}